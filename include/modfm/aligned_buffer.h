@@ -0,0 +1,43 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <type_traits>
+
+// Fixed size heap array aligned for the widest vector loads the kernels use.
+// Sized once, outside the audio thread; never reallocates.
+template <typename T>
+class AlignedBuffer {
+ public:
+  static constexpr std::align_val_t kAlignment{64};
+
+  AlignedBuffer() = default;
+  explicit AlignedBuffer(size_t size)
+      : data_(static_cast<T *>(::operator new[](size * sizeof(T), kAlignment))),
+        size_(size) {
+    std::uninitialized_value_construct_n(data_.get(), size);
+  }
+  AlignedBuffer(size_t size, const T &value)
+      : data_(static_cast<T *>(::operator new[](size * sizeof(T), kAlignment))),
+        size_(size) {
+    std::uninitialized_fill_n(data_.get(), size, value);
+  }
+
+  T *data() { return data_.get(); }
+  const T *data() const { return data_.get(); }
+  size_t size() const { return size_; }
+  T &operator[](size_t i) { return data_[i]; }
+  const T &operator[](size_t i) const { return data_[i]; }
+
+ private:
+  // Only for trivially destructible T, which is all the render path uses.
+  struct Deleter {
+    void operator()(T *p) const { ::operator delete[](p, kAlignment); }
+  };
+  static_assert(std::is_trivially_destructible_v<T>);
+
+  std::unique_ptr<T[], Deleter> data_;
+  size_t size_ = 0;
+};
@@ -0,0 +1,22 @@
+#pragma once
+
+// While a ScopedAllocationGuard is alive on a thread, any heap allocation on
+// that thread is fatal. Player::Perform holds one so that allocations
+// creeping back into the render path show up in testing rather than as
+// dropouts.
+//
+// Only active when built with MODFM_ALLOCATION_GUARD (the default for Debug
+// builds), which replaces the global operator new. Otherwise it's a no-op.
+class ScopedAllocationGuard {
+ public:
+#ifdef MODFM_ALLOCATION_GUARD
+  ScopedAllocationGuard();
+  ~ScopedAllocationGuard();
+#else
+  ScopedAllocationGuard() {}
+  ~ScopedAllocationGuard() {}
+#endif
+
+  ScopedAllocationGuard(const ScopedAllocationGuard &) = delete;
+  ScopedAllocationGuard &operator=(const ScopedAllocationGuard &) = delete;
+};
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+
+// Halves the sample rate through a Kaiser windowed half-band low pass. Every
+// other coefficient of a half-band filter is zero apart from the centre one,
+// so in polyphase form an output costs (Taps + 1) / 4 multiplies of symmetric
+// pairs from the even inputs plus one for the centre tap.
+template <int Taps>
+class HalfbandDecimator {
+  static_assert(Taps % 4 == 3, "Half-band filters have 4n + 3 taps");
+
+ public:
+  // Outputs per pass over the history; longer calls take several.
+  static constexpr size_t kMaxFrames = 128;
+
+  // Reads 2 * `frames` samples from `in` and writes `frames` to `out`.
+  void Process(const float in[], float out[], size_t frames);
+
+  void Reset() { history_.fill(0.0f); }
+
+ private:
+  std::array<float, Taps - 1> history_{};
+};
+
+// Brings a generator rendered at 2x or 4x the output rate back down, one
+// half-band stage per octave. The last stage sets the response: flat to 0.4
+// of the output rate and down 70 dB from 0.6. The 4x stage in front of it only
+// has to clear what would fold into that passband, so it is shorter.
+//
+// Input frame i is the `factor` samples whose last one lines up with output
+// frame i. The filters delay by a fraction of a frame on their own, so the
+// input goes in one sample late to make the delay whole frames, Delay(factor).
+// Generators at different factors line up when they all pad their delay out
+// to the same latency.
+class Decimator {
+ public:
+  static constexpr int kMaxFactor = 4;
+  static constexpr int kMaxDelay = 15;
+
+  static constexpr int Delay(int factor) {
+    return factor == 4 ? kMaxDelay : factor == 2 ? 12 : 0;
+  }
+
+  // Reads `factor` * `frames` samples from `in` and writes `frames` to `out`,
+  // `latency()` frames late. `factor` is 1, 2 or 4; at 1 `in` may be `out`.
+  void Process(int factor, const float in[], float out[], size_t frames);
+
+  // Frames of delay at every factor up to the one `latency` is the Delay()
+  // of. Clears the padding.
+  void SetLatency(int latency);
+  int latency() const { return latency_; }
+
+  void Reset();
+
+ private:
+  // Delays `buffer` in place by `latency_` - Delay(`factor`) frames.
+  void Pad(int factor, float buffer[], size_t frames);
+
+  HalfbandDecimator<27> from_4x_;
+  HalfbandDecimator<47> from_2x_;
+  // Last input sample, held back for the next call.
+  float carry_ = 0.0f;
+  int latency_ = 0;
+  std::array<float, kMaxDelay> padding_{};
+  int pad_frames_ = 0;
+  int pad_pos_ = 0;
+};
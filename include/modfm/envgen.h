@@ -1,9 +1,37 @@
 #pragma once
 
+#include <array>
 #include <cmath>
 
 #include "patch.h"
 
+// A multi-stage envelope: a run of exponential segments, an optional loop
+// over some of them while the note is held, a sustain point, and a release.
+// Trivially copyable so it can be built per block from patch data.
+struct EnvelopeProgram {
+  static constexpr int kMaxSegments =
+      2 + GeneratorPatch::Envelope::kMaxSegments;
+
+  using Segment = GeneratorPatch::Envelope::Segment;
+
+  std::array<Segment, kMaxSegments> segments;
+  int num_segments = 0;
+  // Hold at the end of this segment until note off. The envelope also holds
+  // after the last segment.
+  int sustain = -1;
+  // While the note is held, finishing segment `loop_end` jumps back to
+  // `loop_start`. Disabled when negative.
+  int loop_start = -1;
+  int loop_end = -1;
+  // Seconds to fall from wherever the envelope is to silence on note off.
+  float release_time = 0.0f;
+
+  // The attack, the decay and then `env`'s further segments. Indices and
+  // times that are out of range, as a patch bank could hold, are dropped or
+  // clamped.
+  static EnvelopeProgram FromEnvelope(const GeneratorPatch::Envelope &env);
+};
+
 class EnvelopeGenerator {
  public:
   explicit EnvelopeGenerator(int sample_rate)
@@ -12,9 +40,12 @@ class EnvelopeGenerator {
         current_level_(minimum_level_),
         coefficient_(1.0),
         sample_rate_(sample_rate),
+        segment_(0),
         current_sample_index_(0),
         next_stage_sample_index_(0){};
 
+  // Coarse view of where the envelope is. ATTACK is the first segment of the
+  // program and DECAY any later one; SUSTAIN is holding for note off.
   enum EnvelopeStage {
     ENVELOPE_STAGE_OFF = 0,
     ENVELOPE_STAGE_ATTACK,
@@ -24,22 +55,53 @@ class EnvelopeGenerator {
     kNumEnvelopeStages
   };
 
-  void EnterStage(EnvelopeStage new_stage,
-                  const GeneratorPatch::Envelope &envelope);
-  float NextSample(const GeneratorPatch::Envelope &env);
+  void NoteOn(const EnvelopeProgram &program);
+  void NoteOff(const EnvelopeProgram &program);
+  void Stop();
+
+  float NextSample(const EnvelopeProgram &program);
+
+  // Writes `scale` times the next `frames` levels to `out`. Equivalent to
+  // calling NextSample() `frames` times, but only branches at segment
+  // boundaries and evaluates each segment in closed form.
+  void Render(const EnvelopeProgram &program, float scale, float out[],
+              size_t frames);
+
+  // Moves the envelope on `frames` samples as Render() would, without
+  // writing the levels anywhere.
+  void Skip(const EnvelopeProgram &program, size_t frames);
+
   void SetSampleRate(float newSampleRate);
   inline EnvelopeStage Stage() const { return stage_; };
 
   bool Playing() const { return stage_ != ENVELOPE_STAGE_OFF; };
 
+  // Level after the last sample rendered, unscaled.
+  float level() const { return current_level_; }
+
+  // Highest level the envelope can reach from here on, unscaled.
+  float Ceiling(const EnvelopeProgram &program) const;
+
  private:
   const float minimum_level_;
   float CalculateCoefficient(float start_level, float end_level,
                              size_t length_in_samples) const;
+  bool Running() const {
+    return stage_ != ENVELOPE_STAGE_OFF && stage_ != ENVELOPE_STAGE_SUSTAIN;
+  }
+  // Called when the current segment (or the release) has run its length.
+  void EndSegment(const EnvelopeProgram &program);
+  // Segments start from where the one before was headed rather than where
+  // the exponential approximation actually got to, so error doesn't build up.
+  void EnterSegment(int segment, float start_level,
+                    const EnvelopeProgram &program);
+  void Hold(float level);
+
   EnvelopeStage stage_;
   float current_level_;
   float coefficient_;
   float sample_rate_;
+  int segment_;
   size_t current_sample_index_;
   size_t next_stage_sample_index_;
 };
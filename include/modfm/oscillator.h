@@ -6,16 +6,121 @@
 
 #include "patch.h"
 
+class Wavetable;
+
 class Oscillator {
  public:
-  void Perform(size_t buffer_size, uint16_t sample_rate,
-               std::complex<float> buffer[], float freq, const float level_a[],
-               const float level_c[], const float level_m[],
-               const float level_r[], const float level_s[],
+  // Instruction sets Perform() can dispatch to, in ascending order.
+  enum class ISA { kScalar = 0, kSSE2, kAVX2, kAVX512 };
+
+  // How carrier and modulator angles are tracked between frames.
+  enum class PhaseMode {
+    // Time is a float sample counter divided by the sample rate, as the
+    // oscillator originally worked. Phase precision degrades after ~2^24
+    // samples; kept for comparing against old renders.
+    kSampleClock,
+    // Wrapped double precision carrier and modulator phases, advanced by
+    // freq / sample_rate every frame. The default.
+    kAccumulator,
+    // Unit phasors advanced by a complex multiply every frame, so there is no
+    // trig on the carrier or modulator angle. Rotators are only recomputed
+    // when the frequency changes, and the phasors are re-anchored to the
+    // wrapped accumulators every kChunkFrames frames. Cheapest on the scalar
+    // path; the vector kernels evaluate phases about as fast as they can be
+    // rotated.
+    kPhasor,
+  };
+
+  // Accuracy / cost trade-off for the sin and cos evaluations in the ModFM
+  // formula. Bounds are the maximum absolute error of a single evaluation.
+  // They enter the output scaled by A, and errors in the modulator terms are
+  // additionally scaled by R * K and S * K.
+  enum class Quality {
+    // Scalar libm in single precision (~1e-7), independent of ActiveISA().
+    // With PhaseMode::kSampleClock this is exactly the original complex
+    // valued loop. Meant for offline renders; Generator never substitutes
+    // wavetables at this tier.
+    kReference,
+    // Degree 11 odd polynomial on the SIMD kernels (< 2.5e-7, see SinTurns()
+    // in src/oscillator_kernel_impl.h). The default.
+    kPolynomial,
+    // 1024 entry sine table with linear interpolation, bounded by
+    // (2 * pi / 1024)^2 / 8 (< 4.8e-6). For scalar builds only: roughly twice
+    // as fast as kReference there, but per-lane lookups make it slower than
+    // kPolynomial on the vector kernels, so it renders as kPolynomial unless
+    // ActiveISA() is kScalar.
+    kTable,
+  };
+
+  // Frames per call into the kernel in the accumulator and phasor modes; the
+  // per-frame angles live in stack buffers of this size. Also a good block
+  // size for callers fusing envelopes into the render.
+  static constexpr size_t kChunkFrames = 64;
+
+  // Adds `buffer_size` frames of output to `buffer`. `osc` supplies C, M, R
+  // and S; amplitude and modulation index come per frame with the envelopes
+  // already applied.
+  void Perform(size_t buffer_size, int sample_rate,
+               float buffer[], float freq,
+               const GeneratorPatch::Osc &osc, const float level_a[],
                const float level_k[]);
 
-  void Reset() { x_ = 0.0f; }
+  // As above, with C, M, R and S moving by `step` every frame from their
+  // values in `osc` at the first frame. R and S ramp exactly; C and M ramp in
+  // PhaseMode::kAccumulator and step once per chunk in the other modes. A and
+  // K of `step` are ignored; fold them into the levels.
+  void Perform(size_t buffer_size, int sample_rate,
+               float buffer[], float freq,
+               const GeneratorPatch::Osc &osc, const GeneratorPatch::Osc &step,
+               const float level_a[], const float level_k[]);
+
+  // Plays back `wavetable` at `freq` instead of evaluating the formula.
+  // Switching between this and Perform() carries the phase over, for ratios
+  // a table can hold.
+  void PerformWavetable(const Wavetable &wavetable, size_t buffer_size,
+                        int sample_rate, float buffer[],
+                        float freq, const float level_a[],
+                        const float level_k[]);
+
+  void Reset();
+
+  void SetPhaseMode(PhaseMode mode) { phase_mode_ = mode; }
+  PhaseMode phase_mode() const { return phase_mode_; }
+
+  void SetQuality(Quality quality) { quality_ = quality; }
+  Quality quality() const { return quality_; }
+
+  // Best instruction set supported by the host CPU, detected once at startup.
+  static ISA SupportedISA();
+
+  // Instruction set used by Perform() for the kPolynomial and kTable quality
+  // tiers. Defaults to SupportedISA().
+  static ISA ActiveISA();
+
+  // Restricts dispatch, e.g. to compare against the scalar loop. Requests for
+  // anything above SupportedISA() are clamped to it.
+  static void SetActiveISA(ISA isa);
+
+  static const char *ISAName(ISA isa);
+  static const char *QualityName(Quality quality);
 
  private:
+  void AdvancePhases(size_t frames, double inc_c, double dinc_c, double inc_m,
+                     double dinc_m, float phase_c[], float phase_m[]);
+  void AdvancePhasors(size_t frames, double inc_c, double inc_m, float cos_c[],
+                      float sin_c[], float cos_m[], float sin_m[]);
+
+  PhaseMode phase_mode_ = PhaseMode::kAccumulator;
+  Quality quality_ = Quality::kPolynomial;
   float x_ = 0.0f;
-};
\ No newline at end of file
+  double phase_c_ = 0.0;
+  double phase_m_ = 0.0;
+  // Turns of the base period, kept by both paths; the formula takes its
+  // phases from it after the table has been playing.
+  uint32_t table_phase_ = 0;
+  bool on_table_ = false;
+  double rot_inc_c_ = 0.0;
+  double rot_inc_m_ = 0.0;
+  std::complex<double> rot_c_ = 1.0;
+  std::complex<double> rot_m_ = 1.0;
+};
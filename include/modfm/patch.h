@@ -1,10 +1,19 @@
 #pragma once
 
+#include <array>
+#include <cstdint>
 #include <functional>
+#include <memory>
 #include <mutex>
+#include <optional>
 #include <sigslot/signal.hpp>
 #include <vector>
 
+#include "snapshot.h"
+
+class Patch;
+class Wavetable;
+
 struct GeneratorPatch {
  public:
   GeneratorPatch(float ratio, float amplitude);
@@ -14,35 +23,132 @@ struct GeneratorPatch {
 
     bool operator==(const Osc &rhs) const;
   };
+  // ADSR, optionally with further segments after the decay, a sustain point
+  // and a loop. Segments are numbered from the attack, 0, and the decay, 1.
   struct Envelope {
+    static constexpr int kMaxSegments = 6;
+
+    struct Segment {
+      float level;  // level reached at the end of the segment
+      float time;   // seconds
+    };
+
     float A_R;  // attack rate
     float A_L;  // attack peak level
     float D_R;  // decay rate
     float S_L;  // sustain level
     float R_R;  // release rate
+    // Played after the decay.
+    std::array<Segment, kMaxSegments> segments{};
+    int8_t num_segments = 0;
+    // Hold at the end of this segment until note off; by default after the
+    // last one.
+    int8_t sustain = -1;
+    // While the note is held, finishing `loop_end` jumps back to
+    // `loop_start`. Disabled when negative.
+    int8_t loop_start = -1;
+    int8_t loop_end = -1;
     bool operator==(const Envelope &rhs) const;
   };
+  // Control signals added onto Osc parameters. Each route adds depth times
+  // its source to its target; sources are sampled at the player's control
+  // rate and targets ramped linearly in between.
+  struct Modulation {
+    static constexpr int kNumLFOs = 2;
+    static constexpr int kMaxRoutes = 8;
+
+    enum class Source : uint8_t {
+      kLFO1,         // -1 to 1
+      kLFO2,         // -1 to 1
+      kAmpEnvelope,  // level of the A envelope
+      kModEnvelope,  // level of the K envelope
+      kVelocity,     // note on velocity, 0 to 1
+      kCC,           // MIDI controller `cc`, 0 to 1
+    };
+    enum class Target : uint8_t { kC, kA, kM, kK, kR, kS };
+
+    // One per voice, restarted on note on.
+    struct LFO {
+      enum class Shape : uint8_t { kSine, kTriangle, kSaw, kSquare };
+      Shape shape = Shape::kSine;
+      float rate = 5.0f;  // Hz
+    };
+    struct Route {
+      Source source;
+      Target target;
+      uint8_t cc;
+      float depth;
+    };
+
+    std::array<LFO, kNumLFOs> lfos;
+    std::array<Route, kMaxRoutes> routes{};
+    int num_routes = 0;
+
+    bool operator==(const Modulation &rhs) const;
+  };
   GeneratorPatch(const Osc &osc, const Envelope &a_env, const Envelope &k_env);
 
   bool operator==(const GeneratorPatch &rhs) const;
 
-  void WithLock(
-      std::function<void(const Osc &, const Envelope &, const Envelope &)> f)
-      const;
+  // Calls f(osc, a_env, k_env) with the patch locked.
+  template <typename F>
+  void WithLock(F f) const {
+    std::lock_guard<std::mutex> lg(gp_mutex_);
+    f(osc_, a_env_, k_env_);
+  }
 
+  // Also publishes a new snapshot of the owning patch.
   void Update(std::optional<Osc> osc, std::optional<Envelope> a_env,
               std::optional<Envelope> k_env);
 
+  // Also publishes a new snapshot of the owning patch.
+  void SetModulation(const Modulation &modulation);
+  Modulation modulation() const;
+
+  // Wavetable for the current oscillator and K envelope, or nullptr if the
+  // oscillator doesn't have integer ratios. Rebuilt (or fetched from the
+  // shared cache) whenever Update() changes either.
+  std::shared_ptr<const Wavetable> wavetable() const;
+
  private:
+  friend class Patch;
+
+  static std::shared_ptr<const Wavetable> WavetableFor(const Osc &osc,
+                                                       const Envelope &k_env);
+
   mutable std::mutex gp_mutex_;
 
   Osc osc_;
   Envelope a_env_;
   Envelope k_env_;
+  Modulation modulation_;
+  std::shared_ptr<const Wavetable> wavetable_;
+  // Bumped by every Update() that changes the table.
+  uint64_t wavetable_generation_ = 0;
+  // Set when added to a Patch.
+  Patch *owner_ = nullptr;
+};
+
+// Immutable copy of a whole patch, as seen by the audio thread.
+struct PatchSnapshot {
+  struct Generator {
+    // Identifies which GeneratorPatch this was copied from.
+    const GeneratorPatch *source;
+    GeneratorPatch::Osc osc;
+    GeneratorPatch::Envelope a_env;
+    GeneratorPatch::Envelope k_env;
+    GeneratorPatch::Modulation modulation;
+    std::shared_ptr<const Wavetable> wavetable;
+  };
+
+  uint64_t version = 0;
+  std::vector<Generator> generators;
 };
 
 class Patch {
  public:
+  Patch();
+
   GeneratorPatch *AddGenerator();
   void RmGenerator(GeneratorPatch *patch);
   sigslot::signal<GeneratorPatch *> AddGeneratorSignal;
@@ -50,9 +156,22 @@ class Patch {
 
   std::vector<const GeneratorPatch *> generators() const;
 
+  // Pins the latest published snapshot without locking. Meant for the audio
+  // thread; at most one may be alive at a time. Snapshots are only ever
+  // freed by threads editing the patch.
+  using SnapshotReader = SnapshotPublisher<PatchSnapshot>::Reader;
+  SnapshotReader snapshot() const { return SnapshotReader(snapshots_); }
+
  private:
+  friend class GeneratorPatch;
+
+  void Publish();
+  void PublishLocked();
+
   mutable std::mutex patches_mutex_;
   std::vector<std::unique_ptr<GeneratorPatch>> generators_;
+  SnapshotPublisher<PatchSnapshot> snapshots_;
+  uint64_t version_ = 0;
 };
 
 constexpr GeneratorPatch::Envelope kDefaultAmpEnvelope{0.025, 0.175, 0.25,
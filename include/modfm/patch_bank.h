@@ -0,0 +1,112 @@
+#pragma once
+
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "patch.h"
+
+// A read only file of many patches ("programs"), memory mapped and used in
+// place. The layout is the header, then a Program for every program, then a
+// Generator for every generator of every program, with each program's
+// generators contiguous:
+//
+//   Header | Program[num_programs] | Generator[num_generators]
+//
+// Records are the in-memory structs, little endian, so nothing is parsed:
+// opening checks the header and the file size, and a program's settings are
+// read straight out of the mapping when it is selected. Pages of programs
+// never selected are never read.
+class PatchBank {
+ public:
+  static constexpr char kMagic[8] = {'M', 'O', 'D', 'F', 'M', 'B', 'N', 'K'};
+  // Bumped whenever a record changes shape.
+  static constexpr uint32_t kVersion = 2;
+  static constexpr size_t kNameSize = 24;
+
+  struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t num_programs;
+    uint32_t num_generators;
+    // Most generators in any one program.
+    uint32_t max_generators;
+    uint64_t reserved;
+  };
+
+  struct Program {
+    // NUL padded; not necessarily NUL terminated.
+    char name[kNameSize];
+    // Index of the program's first record in the generator array.
+    uint32_t first_generator;
+    uint32_t num_generators;
+  };
+
+  struct Generator {
+    GeneratorPatch::Osc osc;
+    GeneratorPatch::Envelope a_env;
+    GeneratorPatch::Envelope k_env;
+    GeneratorPatch::Modulation modulation;
+  };
+
+  // A program to write, as it would be built up in a Patch.
+  struct Entry {
+    std::string name;
+    std::vector<Generator> generators;
+  };
+
+  // Maps the bank at `path`. Costs the same whatever the bank's size.
+  static absl::StatusOr<std::unique_ptr<PatchBank>> Open(
+      const std::string &path);
+
+  static absl::Status Write(const std::string &path,
+                            const std::vector<Entry> &programs);
+
+  // The settings of every generator of `patch`, in order.
+  static Entry FromPatch(const Patch &patch, std::string name);
+
+  ~PatchBank();
+
+  PatchBank(const PatchBank &) = delete;
+  PatchBank &operator=(const PatchBank &) = delete;
+
+  int num_programs() const { return header_->num_programs; }
+  int max_generators() const { return header_->max_generators; }
+
+  std::string_view name(int program) const;
+
+  // The generators of `program`, read in place. Empty if there is no such
+  // program or its record points outside the bank. Never allocates, so safe
+  // on the audio thread; records are copied out through Load().
+  std::span<const Generator> generators(int program) const;
+
+  // Copies `generator` into `out` for the player, keeping values that would
+  // index out of bounds in range. `out` plays without a wavetable.
+  static void Load(const Generator &generator, PatchSnapshot::Generator *out);
+
+ private:
+  PatchBank(const void *data, size_t size);
+
+  const void *data_;
+  size_t size_;
+  const Header *header_;
+  const Program *programs_;
+  const Generator *generators_;
+};
+
+static_assert(std::endian::native == std::endian::little,
+              "Patch banks are little endian");
+static_assert(std::is_trivially_copyable_v<PatchBank::Generator> &&
+              std::is_standard_layout_v<PatchBank::Generator>);
+static_assert(sizeof(PatchBank::Header) == 32);
+static_assert(sizeof(PatchBank::Program) == 32);
+static_assert(sizeof(PatchBank::Generator) == 252,
+              "Bump PatchBank::kVersion when the record layout changes");
@@ -1,67 +1,434 @@
 #pragma once
 
+#include <array>
+#include <limits>
+#include <memory>
 #include <mutex>
+#include <optional>
 #include <vector>
 
+#include "aligned_buffer.h"
+#include "decimator.h"
 #include "envgen.h"
 #include "oscillator.h"
+#include "patch_bank.h"
+#include "render_pool.h"
+#include "render_stats.h"
+#include "spsc_queue.h"
 
 class GUI;
 
-class Generator {
+// Latest value of every MIDI controller, scaled to 0 to 1.
+using ControllerValues = std::array<float, 128>;
+
+// Starts on a cache line of its own, so workers rendering neighbouring
+// generators of a bank never write to the same line.
+class alignas(64) Generator {
 public:
+  static constexpr size_t kDefaultControlPeriod = 64;
+
   explicit Generator(int sample_frequency);
 
-  void Perform(const GeneratorPatch &patch, std::complex<float> *out_buffer,
-               float base_freq, size_t frames_per_buffer);
+  // Renders and adds `frames_per_buffer` frames to `mix_buffer`. `controllers`
+  // feeds the patch's kCC modulation routes.
+  void Perform(const PatchSnapshot::Generator &patch,
+               float *mix_buffer, float base_freq,
+               const ControllerValues &controllers, size_t frames_per_buffer);
 
-  void NoteOn(const GeneratorPatch &patch, unsigned long ts, uint8_t velocity,
-              uint8_t note);
+  void NoteOn(const PatchSnapshot::Generator &patch, unsigned long ts,
+              uint8_t velocity, uint8_t note);
 
-  void NoteOff(const GeneratorPatch &patch, uint8_t note);
+  void NoteOff(const PatchSnapshot::Generator &patch, uint8_t note);
 
   bool Playing() const;
 
+  // Works out the frequency range the note can reach at `base_freq`: whether
+  // all of it is above Nyquist, and with index clamping on, the K that keeps
+  // its sidebands below. Call after NoteOn() and whenever the pitch or the
+  // patch changes.
+  void UpdateRange(const PatchSnapshot::Generator &patch, float base_freq);
+
+  // Stops the generator if nothing it plays for the rest of the note can
+  // exceed `threshold` in amplitude, and returns whether it did.
+  bool Cull(const PatchSnapshot::Generator &patch, float threshold);
+
+  // Whether everything the note can reach lies above Nyquist, as of the last
+  // UpdateRange(). Such a generator is silent for now but keeps playing: a
+  // patch edit can bring it back down.
+  bool ultrasonic() const { return ultrasonic_; }
+
+  // Moves the note on `frames` frames without rendering it, for while it is
+  // ultrasonic. Envelopes and LFOs keep time; the oscillator and modulation
+  // ramps start afresh once it renders again.
+  void Skip(const PatchSnapshot::Generator &patch, size_t frames);
+
   void Stop();
 
+  // Stops and puts oscillator phases and modulation state back to how they
+  // were after construction.
+  void Reset();
+
+  void SetQuality(Oscillator::Quality quality) { o_.SetQuality(quality); }
+
+  // Frames between evaluations of the modulation routes.
+  void SetControlPeriod(size_t frames) { control_period_ = frames; }
+
+  // Highest oversampling factor, 1, 2 or 4, for notes whose sidebands would
+  // otherwise fold back below Nyquist. 1 turns oversampling off. Output is
+  // delayed by Decimator::Delay() of the factor whatever factor a note plays
+  // at, so generators line up as long as they share the setting.
+  void SetMaxOversampling(int factor);
+
+  // Lowest factor, to send even band limited notes through the decimator.
+  // Mostly for comparing factors.
+  void SetMinOversampling(int factor);
+
+  // Frames the output lags the notes by.
+  int latency() const { return decimator_.latency(); }
+
+  // Factor the current note renders at.
+  int oversampling() const { return oversampling_; }
+
+  // Limit K so that the sidebands stay below Nyquist, dulling high notes
+  // instead of letting them alias. Takes effect from the next UpdateRange().
+  void SetIndexClamping(bool clamp) { clamp_index_ = clamp; }
+
+  const Oscillator &oscillator() const { return o_; }
+
 private:
+  // Samples the modulation sources and sets up ramps from the current
+  // parameters to the new targets over the next control period.
+  void ControlTick(const PatchSnapshot::Generator &patch,
+                   const ControllerValues &controllers);
+
+  // Limits the modulation index to k_limit_.
+  void ClampIndex(float level_k[], size_t frames) const;
+
+  // Lowest factor that keeps everything the patch can reach over the rest
+  // of the note from aliasing into the audible band at `base_freq`.
+  int OversamplingFor(const PatchSnapshot::Generator &patch,
+                      const EnvelopeProgram &k_program, float base_freq) const;
+
+  // Oscillator::Perform() at oversampling_ times the sample rate, decimated
+  // and added to `mix_buffer`.
+  void PerformOversampled(size_t frames, float *mix_buffer,
+                          float base_freq, const GeneratorPatch::Osc &osc,
+                          const GeneratorPatch::Osc &step,
+                          const float level_a[], const float level_k[]);
+
   const int sample_frequency_;
   EnvelopeGenerator e_a_;
   EnvelopeGenerator e_k_;
   Oscillator o_;
+
+  // Modulation state.
+  size_t control_period_ = kDefaultControlPeriod;
+  // Frames left until the next ControlTick().
+  size_t control_countdown_ = 0;
+  // Jump straight to the first targets after note on rather than ramp.
+  bool snap_ = true;
+  float velocity_ = 0.0f;
+  std::array<double, GeneratorPatch::Modulation::kNumLFOs> lfo_phases_{};
+  // Parameters at the next frame, and their per-frame change.
+  GeneratorPatch::Osc current_{};
+  GeneratorPatch::Osc step_{};
+
+  // Oversampling state. The factor is chosen on the first block of each note
+  // and kept to its end: switching would restart the decimator mid note and
+  // click. Patch edits that need more take effect from the next note.
+  int max_oversampling_ = Decimator::kMaxFactor;
+  int min_oversampling_ = 1;
+  int oversampling_ = 1;
+  bool choose_oversampling_ = true;
+  Decimator decimator_;
+  // Last levels of the previous block, to interpolate the next block's from.
+  float last_level_a_ = 0.0f;
+  float last_level_k_ = 0.0f;
+
+  // From UpdateRange().
+  bool clamp_index_ = false;
+  float k_limit_ = std::numeric_limits<float>::infinity();
+  bool ultrasonic_ = false;
 };
 
 class Player {
 public:
-  Player(Patch *gennum, int num_voices, int sample_frequency);
+  static constexpr size_t kDefaultMaxFramesPerBuffer = 4096;
+
+  // Render scratch is allocated here for up to `max_frames_per_buffer`
+  // frames; Perform() never allocates. Larger buffers are rendered in
+  // several passes. Rendering is spread over `render_threads` threads,
+  // counting the one calling Perform(); 0 means one per core but one.
+  Player(Patch *gennum, int num_voices, int sample_frequency,
+         size_t max_frames_per_buffer = kDefaultMaxFramesPerBuffer,
+         int render_threads = 0);
+  ~Player();
 
+  // `block_time_ms` is when the first frame of the buffer will be heard, on
+  // the clock note timestamps are taken from. Notes are then placed at the
+  // frame their timestamp plus the event latency falls on. Without it, notes
+  // queued since the last call start at the beginning of the buffer.
   bool Perform(const void *in_buffer, void *out_buffer,
-               size_t frames_per_buffer);
+               size_t frames_per_buffer,
+               std::optional<double> block_time_ms = std::nullopt);
 
+  // Queue a note for the audio thread to start or stop. Never blocks; must
+  // only be called from one thread. `ts` is in milliseconds.
   void NoteOn(unsigned long ts, uint8_t velocity, uint8_t note);
 
-  void NoteOff(uint8_t note);
+  void NoteOff(unsigned long ts, uint8_t note);
+
+  // Queue a controller change, timed like notes. `value` is 0 to 127.
+  void ControlChange(unsigned long ts, uint8_t controller, uint8_t value);
+
+  // Queue a switch to `program` of the patch bank, timed like notes. As in
+  // MIDI, the bank select controllers (0 and 32) pick which 128 programs
+  // `program` counts from. Notes already sounding carry on with the new
+  // program's settings, as they would through a patch edit, except that
+  // notes started from the live patch are cut. Programs the bank doesn't
+  // have are ignored.
+  void ProgramChange(unsigned long ts, uint8_t program);
+
+  // Programs are played from `bank` from the first ProgramChange() on,
+  // instead of the live patch. The switch happens on the audio thread at a
+  // block boundary and only copies the program's records out of the bank:
+  // room for its largest program is allocated here. Bank programs render
+  // with the formula, never a wavetable. `bank` must outlive the player or
+  // the next call; nullptr goes back to the live patch.
+  void SetPatchBank(const PatchBank *bank);
+
+  // Generators that can't rise above `db` (full scale being 1.0) for the rest
+  // of their note are stopped, and their voice reclaimed once all of its
+  // generators are. This cuts release tails short and skips generators with
+  // no amplitude. -infinity disables it.
+  void SetAudibilityThreshold(float db);
+
+  // Modulation routes are evaluated every `frames` frames and ramped in
+  // between. Shorter periods follow fast LFOs and envelopes more closely.
+  void SetControlPeriod(size_t frames);
+
+  // Generators whose modulation would push sidebands past Nyquist render at
+  // 2x or 4x the sample rate, up to `factor`, and are decimated back down.
+  // Generators that fit in the band, and wavetable ones, render at the
+  // sample rate but are delayed to line up: output lags the notes by
+  // Decimator::Delay(factor) frames, 15 at the default of 4. 1 turns it off.
+  // The factor is picked per note at note on.
+  void SetMaxOversampling(int factor);
+
+  // Clamp each note's modulation index so its sidebands stay below Nyquist,
+  // trading brightness on high notes for no aliasing and no oversampling.
+  // Off by default. Generators entirely above Nyquist are skipped either way.
+  void SetIndexClamping(bool clamp);
+
+  // Silences every voice and returns the player to its state after
+  // construction, dropping queued events and controller values, so what
+  // follows renders the same whatever came before. Settings are kept. Call
+  // from the thread that calls Perform().
+  void Reset();
+
+  // Generators not yet started once this fraction of the buffer's duration
+  // has passed since Perform() was called sit the buffer out, trading a
+  // glitch in a few voices for a dropout in all of them. 0 renders
+  // everything however long it takes, for offline use.
+  void SetDeadline(double fraction);
+
+  // Constant delay added to note timestamps. It has to cover the time from a
+  // note arriving to its buffer being rendered and played, otherwise notes
+  // are late and fall back to block timing: output latency plus one buffer.
+  void SetEventLatency(double latency_ms);
+
+  // Applies to every generator of every voice, including generators added
+  // later. Use kReference for offline renders and kTable or kPolynomial to
+  // buy polyphony on live rigs.
+  void SetQuality(Oscillator::Quality quality);
+  Oscillator::Quality quality() const { return quality_; }
+
+  // Load, overruns and underruns since construction. Readable from any
+  // thread while Perform() runs.
+  const RenderStats &stats() const { return stats_; }
+
+  // For the audio callback to count the host's output underflows.
+  void ReportUnderrun() { stats_.RecordUnderrun(); }
 
 private:
-  struct Voice {
-    std::vector<std::unique_ptr<Generator>> generators_;
-    int32_t on_time;
+  static constexpr size_t kEventQueueSize = 1024;
+  static constexpr size_t kLayoutQueueSize = 16;
+
+  struct NoteEvent {
+    enum class Type : uint8_t {
+      kNoteOn,
+      kNoteOff,
+      kControlChange,
+      kProgramChange
+    };
+    Type type;
+    // Controller number and value for kControlChange, program number for
+    // kProgramChange.
     uint8_t note;
-    float velocity;
+    uint8_t velocity;
+    unsigned long ts;
+  };
+
+  struct ScheduledEvent {
+    NoteEvent event;
+    // On the player's frame clock.
+    uint64_t frame;
+  };
+
+  struct Voice {
+    uint8_t note = 0;
+    uint8_t velocity = 0;
+    float base_freq = 0.0f;
+    // Neighbours in the active list, as indices into voices_; -1 at the ends.
+    int prev = -1;
+    int next = -1;
+  };
+
+  struct RenderTask {
+    Generator *generator;
+    const PatchSnapshot::Generator *patch;
     float base_freq;
+  };
 
-    bool Playing() const;
+  // The voices' generators for one arrangement of the live patch's
+  // generators. A new one is built on the thread adding or removing a
+  // generator and swapped in by the audio thread at the start of a buffer,
+  // so the audio thread never waits on an edit or allocates for one.
+  struct VoiceLayout {
+    // Mirrors the patch's generators. Matched against snapshots to line them
+    // up with the banks.
+    std::vector<const GeneratorPatch *> generators;
+    // One bank per generator, holding that generator for every voice in
+    // voice order, in a single allocation. Banks group whole Generators, not
+    // their state: there is no structure of arrays, and each voice's
+    // generator still renders on its own, vectorized over frames rather than
+    // across voices.
+    std::vector<AlignedBuffer<Generator>> banks;
+    // Per generator, the index of its bank in the layout this one replaces,
+    // moved across on swap-in so notes carry on where they were; -1 for a
+    // new generator, whose bank is allocated with the layout.
+    std::vector<int> carried;
+    // Per bank, the voices whose note started while the snapshot didn't have
+    // this generator where the layout does. They start it late, once the two
+    // agree. Carried along with the banks.
+    std::vector<AlignedBuffer<bool>> pending;
+    // Room for a task per generator per voice; swapped with tasks_ when
+    // bigger.
+    std::vector<RenderTask> tasks;
   };
-  Voice *NewVoice();
-  Voice *VoiceFor(uint8_t note);
+  // Builds a layout for `generators` on top of the last one published and
+  // queues it for the audio thread. Needs layout_mutex_.
+  void PublishLayout(std::vector<const GeneratorPatch *> generators);
+  // Swaps in queued layouts. Needs voices_mutex_.
+  void ApplyLayouts();
+  // Gives a generator the player's settings.
+  void Configure(Generator &g) const;
+  void ScheduleEvents(size_t frames_per_buffer,
+                      std::optional<double> block_time_ms);
+  void ApplyEvent(const PatchSnapshot &snapshot, const NoteEvent &event);
+  void StartNote(const PatchSnapshot &snapshot, unsigned long ts,
+                 uint8_t velocity, uint8_t note);
+  void StopNote(const PatchSnapshot &snapshot, uint8_t note);
+  void RenderBlock(const PatchSnapshot &snapshot, float *out, size_t frames);
+  const PatchSnapshot::Generator *PatchFor(const PatchSnapshot &snapshot,
+                                           int g_num) const;
+  // Live generator `g_num`'s settings wherever they are in `snapshot`, for
+  // moving it on while PatchFor() has it sit out; nullptr if not there.
+  const PatchSnapshot::Generator *FindPatch(const PatchSnapshot &snapshot,
+                                            int g_num) const;
+  void SelectProgram(uint8_t program_change);
+  // What notes play: the selected bank program, or else `patch`.
+  const PatchSnapshot &Current(const PatchSnapshot &patch) const {
+    return program_ >= 0 ? program_snapshot_ : patch;
+  }
+  // The voices' generators for Current().
+  std::vector<AlignedBuffer<Generator>> &CurrentBanks() {
+    return program_ >= 0 ? program_banks_ : layout_->banks;
+  }
+  // Live patch and bank program generators alike.
+  template <typename F>
+  void ForEachGenerator(F f) {
+    for (auto *banks : {&layout_->banks, &program_banks_}) {
+      for (auto &bank : *banks) {
+        for (int v = 0; v < num_voices_; v++) f(bank[v]);
+      }
+    }
+  }
+  // Takes a free voice, or steals the oldest, and makes it the newest
+  // active voice. Voices are numbered by their index in voices_; -1 is none.
+  int NewVoice(const PatchSnapshot &snapshot, uint8_t note);
+  int VoiceFor(uint8_t note) const;
+  bool VoicePlaying(int v) const;
+  void LinkVoice(int v);
+  void UnlinkVoice(int v);
+  // Returns active voices whose generators have all finished to the free list.
+  void ReleaseFinishedVoices();
 
+  // Held by Perform, and by anything changing the voices' generators.
   std::mutex voices_mutex_;
+  // Serialises layout changes. Never taken by the audio thread.
+  std::mutex layout_mutex_;
+  // From the MIDI thread to the audio thread.
+  SpscQueue<NoteEvent, kEventQueueSize> events_;
+  // Popped from events_ but not yet due, in frame order. Audio thread only.
+  std::array<ScheduledEvent, kEventQueueSize> pending_;
+  size_t num_pending_ = 0;
+  double event_latency_ms_ = 0;
 
   Patch *patch_;
   const int num_voices_ = 8;
   const int sample_frequency_;
-  // Track free voices.
-  // Could probably structure this as a ring buffer in order of note-on instead
-  // of using timestamps.
+  const size_t max_frames_per_buffer_;
+  // Generators of the last layout published, kept up to date by the
+  // patch's signals. Guarded by layout_mutex_.
+  std::vector<const GeneratorPatch *> generator_patches_;
+  Oscillator::Quality quality_ = Oscillator::Quality::kPolynomial;
+  size_t control_period_ = Generator::kDefaultControlPeriod;
+  int max_oversampling_ = Decimator::kMaxFactor;
+  bool clamp_index_ = false;
+  // As an amplitude; -70 dB.
+  float audibility_threshold_ = 3.1623e-4f;
+  // Audio thread only.
+  ControllerValues controllers_{};
+  // Frames rendered so far.
+  uint64_t frame_ = 0;
+  // Tags this player's trace records.
+  const uint32_t trace_id_;
+  RenderPool render_pool_;
+  // Rebuilt every block; capacity for every generator of every voice comes
+  // with each layout.
+  std::vector<RenderTask> tasks_;
+  double deadline_fraction_ = 0.9;
+  RenderStats stats_;
+  // Snapshot version generator ranges were last updated for.
+  uint64_t range_version_ = 0;
+  // Snapshot version the last buffer rendered with, to spot patch edits.
+  uint64_t stats_patch_version_ = 0;
+  // Generator tasks rendered so far in the current buffer.
+  size_t rendered_tasks_ = 0;
+  RenderPool::Clock::time_point deadline_;
   std::vector<Voice> voices_;
+  // Audio thread, or whoever holds voices_mutex_.
+  std::unique_ptr<VoiceLayout> layout_;
+  // Layouts on their way in, and replaced ones on their way back to be freed
+  // by the next change. Each change empties the way back before queueing
+  // another, so no more than a full queue plus one can be waiting on it.
+  SpscQueue<VoiceLayout *, kLayoutQueueSize> pending_layouts_;
+  SpscQueue<VoiceLayout *, 2 * kLayoutQueueSize> retired_layouts_;
+
+  // Bank programs, with generator banks of their own for the most
+  // generators any program has. program_ is -1 while the live patch plays.
+  const PatchBank *bank_ = nullptr;
+  int program_ = -1;
+  PatchSnapshot program_snapshot_;
+  std::vector<AlignedBuffer<Generator>> program_banks_;
+  // Voice allocation, all O(1) per note. Only active voices are rendered or
+  // checked for having finished. Audio thread only.
+  std::vector<int> free_voices_;
+  // Sounding voices in note on order, so the front is the one to steal.
+  int active_head_ = -1;
+  int active_tail_ = -1;
+  int num_active_voices_ = 0;
+  // Voice last started on each note, or -1 once it has been let go.
+  std::array<int, 128> note_voices_;
 };
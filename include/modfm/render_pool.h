@@ -0,0 +1,87 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <memory>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include "aligned_buffer.h"
+
+// Render threads that stay up for the life of the player, so a block costs a
+// wake-up rather than a trip through a general purpose scheduler. The calling
+// thread works as worker 0.
+//
+// A Run() splits tasks evenly between the workers up front. Workers that run
+// out take tasks from the others' shares. Worker 0 adds its output straight
+// into the caller's buffer and every other worker into one of its own, which
+// is summed in once all tasks are done.
+class RenderPool {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  // `num_workers` includes the calling thread; 0 means one per core but one,
+  // leaving a core for the rest of the process. Helper threads are each
+  // pinned to a core from 1 up that no other pool's helpers hold, and given
+  // real time priority where the OS allows. Helpers that find every such core
+  // taken run unpinned at normal priority instead of crowding one.
+  RenderPool(int num_workers, size_t max_frames);
+  ~RenderPool();
+
+  RenderPool(const RenderPool &) = delete;
+  RenderPool &operator=(const RenderPool &) = delete;
+
+  int num_workers() const { return workers_.size(); }
+
+  // Calls task(i, buffer) for every i below num_tasks, where buffer is
+  // `frames` long and belongs to whichever worker runs it, and waits for them
+  // all. Tasks add to their buffer; `out` ends up holding the sum of every
+  // task, and zeros if there were none. Tasks not yet started by `deadline`
+  // are skipped. Returns the number skipped. Must only be called from one
+  // thread at a time.
+  template <typename F>
+  size_t Run(size_t num_tasks, size_t frames, Clock::time_point deadline,
+             float *out, F &&task) {
+    return RunTasks(num_tasks, frames, deadline, out, &task,
+                    [](void *f, size_t i, float *buffer) {
+                      (*static_cast<std::remove_reference_t<F> *>(f))(i,
+                                                                      buffer);
+                    });
+  }
+
+ private:
+  using TaskFn = void (*)(void *, size_t, float *);
+
+  struct Worker {
+    // Next task in this worker's share. Others take from it too.
+    alignas(64) std::atomic<size_t> next{0};
+    size_t end = 0;
+    bool used = false;
+    // Unused by worker 0, which writes to the caller's buffer.
+    AlignedBuffer<float> buffer;
+    std::thread thread;
+  };
+
+  size_t RunTasks(size_t num_tasks, size_t frames, Clock::time_point deadline,
+                  float *out, void *task, TaskFn fn);
+  void Work(int worker_num);
+  void WorkerLoop(int worker_num);
+
+  std::vector<std::unique_ptr<Worker>> workers_;
+  // Cores claimed for the helpers, released on destruction.
+  std::vector<int> cpus_;
+
+  // Parameters of the current Run(), published by bumping generation_.
+  void *task_ = nullptr;
+  TaskFn task_fn_ = nullptr;
+  size_t frames_ = 0;
+  float *out_ = nullptr;
+  Clock::time_point deadline_;
+
+  alignas(64) std::atomic<uint64_t> generation_{0};
+  alignas(64) std::atomic<int> busy_workers_{0};
+  std::atomic<size_t> skipped_{0};
+  std::atomic_bool stopping_ = false;
+};
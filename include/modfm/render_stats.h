@@ -0,0 +1,88 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+// How close Player::Perform() runs to its deadline, for sizing polyphony per
+// machine. Load is the time a call takes as a fraction of the duration of
+// the audio it renders; above 1 the buffer can't have been ready in time.
+//
+// Written by the audio thread only, read from any thread without locks.
+class RenderStats {
+ public:
+  // Load histogram buckets are kBucketWidth wide; the last one also counts
+  // every load past the end.
+  static constexpr float kBucketWidth = 0.05f;
+  static constexpr int kNumBuckets = 41;
+  // Overruns kept for attribution.
+  static constexpr int kRecentOverruns = 16;
+
+  struct Overrun {
+    // Player's frame clock at the start of the buffer.
+    uint64_t frame = 0;
+    float load = 0.0f;
+    // Active at the end of the buffer.
+    int voices = 0;
+    // Generator tasks rendered, summed over the buffer's blocks.
+    int generators = 0;
+    // The buffer picked up a patch edit, which would have been copied into
+    // a fresh snapshot and may have added or removed generators.
+    bool patch_edit = false;
+  };
+
+  struct Snapshot {
+    uint64_t buffers = 0;
+    uint64_t overruns = 0;
+    // Reported by the audio host.
+    uint64_t underruns = 0;
+    // Generators that sat a buffer out for missing the render deadline.
+    uint64_t skipped_generators = 0;
+    float last_load = 0.0f;
+    float peak_load = 0.0f;
+    // Exponentially weighted over roughly the last hundred buffers.
+    float average_load = 0.0f;
+    std::array<uint64_t, kNumBuckets> histogram{};
+    // Newest first; `num_recent` of them are valid.
+    std::array<Overrun, kRecentOverruns> recent{};
+    int num_recent = 0;
+  };
+
+  // Audio thread.
+  void RecordBuffer(const Overrun &buffer);
+  void RecordSkipped(size_t generators) {
+    skipped_.fetch_add(generators, std::memory_order_relaxed);
+  }
+
+  // Any thread, typically the audio callback on seeing the host's underflow
+  // flag.
+  void RecordUnderrun() {
+    underruns_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  // Any thread. Counters are read one at a time, so a snapshot taken while
+  // a buffer is being recorded may be off by that buffer; the recent
+  // overruns are always consistent.
+  Snapshot Read() const;
+
+ private:
+  struct OverrunSlot {
+    std::atomic<uint64_t> frame{0};
+    std::atomic<float> load{0.0f};
+    std::atomic<int> voices{0};
+    std::atomic<int> generators{0};
+    std::atomic<bool> patch_edit{false};
+  };
+
+  std::atomic<uint64_t> buffers_{0};
+  std::atomic<uint64_t> overruns_{0};
+  std::atomic<uint64_t> underruns_{0};
+  std::atomic<uint64_t> skipped_{0};
+  std::atomic<float> last_load_{0.0f};
+  std::atomic<float> peak_load_{0.0f};
+  std::atomic<float> average_load_{0.0f};
+  std::array<std::atomic<uint64_t>, kNumBuckets> histogram_{};
+  // Seqlock over recent_: odd while the audio thread is writing a slot.
+  std::atomic<uint32_t> recent_sequence_{0};
+  std::array<OverrunSlot, kRecentOverruns> recent_;
+};
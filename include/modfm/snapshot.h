@@ -0,0 +1,86 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <vector>
+
+// Publishes immutable versions of a T to one real time reader without
+// locks. The reader pins the current version with an epoch announcement and a
+// single pointer load; writers swap in new versions and free old ones once
+// the reader can no longer hold them, so nothing is ever freed on the reader's
+// thread.
+//
+// Writers must be serialised by the caller. Readers must not overlap each
+// other: there is one announcement slot.
+template <typename T>
+class SnapshotPublisher {
+ public:
+  explicit SnapshotPublisher(std::unique_ptr<const T> initial)
+      : current_(initial.release()) {}
+
+  ~SnapshotPublisher() {
+    delete current_.load();
+    for (auto &r : retired_) delete r.snapshot;
+  }
+
+  SnapshotPublisher(const SnapshotPublisher &) = delete;
+  SnapshotPublisher &operator=(const SnapshotPublisher &) = delete;
+
+  // Keeps the version that was current on construction alive until
+  // destroyed.
+  class Reader {
+   public:
+    explicit Reader(const SnapshotPublisher &publisher)
+        : publisher_(publisher) {
+      publisher_.reader_epoch_.store(publisher_.epoch_.load());
+      snapshot_ = publisher_.current_.load();
+    }
+    ~Reader() {
+      publisher_.reader_epoch_.store(kIdle, std::memory_order_release);
+    }
+
+    Reader(const Reader &) = delete;
+    Reader &operator=(const Reader &) = delete;
+
+    const T &operator*() const { return *snapshot_; }
+    const T *operator->() const { return snapshot_; }
+
+   private:
+    const SnapshotPublisher &publisher_;
+    const T *snapshot_;
+  };
+
+  void Publish(std::unique_ptr<const T> next) {
+    const T *old = current_.exchange(next.release());
+    // Readers that announce this epoch or later are guaranteed to see `next`.
+    uint64_t epoch = epoch_.fetch_add(1) + 1;
+    retired_.push_back({old, epoch});
+    Reclaim();
+  }
+
+  // Frees retired versions the reader can't be using any more.
+  void Reclaim() {
+    uint64_t reader = reader_epoch_.load();
+    std::erase_if(retired_, [reader](const Retired &r) {
+      if (reader < r.epoch) return false;
+      delete r.snapshot;
+      return true;
+    });
+  }
+
+ private:
+  static constexpr uint64_t kIdle = std::numeric_limits<uint64_t>::max();
+
+  struct Retired {
+    const T *snapshot;
+    uint64_t epoch;
+  };
+
+  mutable std::atomic<uint64_t> reader_epoch_{kIdle};
+  std::atomic<uint64_t> epoch_{0};
+  std::atomic<const T *> current_;
+  // Writer side only.
+  std::vector<Retired> retired_;
+};
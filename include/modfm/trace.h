@@ -0,0 +1,156 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <thread>
+
+// Tracing for the audio path, where glog's formatting, locks and I/O cause
+// dropouts. Events are fixed size binary records pushed into a preallocated
+// lock-free ring; a TraceDrain on an ordinary thread formats them later.
+//
+// Record with MODFM_TRACE(event, arg, index, value). Records are stamped with
+// the player and frame set by MODFM_TRACE_FRAME on the recording thread, plus
+// any MODFM_TRACE_OFFSET in scope. With MODFM_ENABLE_TRACE undefined (the
+// MODFM_TRACE CMake option) the macros expand to nothing and their arguments
+// are not evaluated.
+
+enum class TraceEvent : uint8_t {
+  // arg: EnvelopeGenerator::EnvelopeStage entered, index: segment,
+  // value: level.
+  kEnvelopeStage,
+  // arg: note taking the voice, index: voice number, value: note it had.
+  kVoiceSteal,
+  // arg: note that couldn't get a voice.
+  kNoVoice,
+  // arg: note released without a voice playing it.
+  kUnmatchedNoteOff,
+  // index: PortAudio stream callback status flags.
+  kStreamStatus,
+  // arg: note dropped because the player's event queue was full.
+  kEventQueueFull,
+  // index: generators skipped for running past the render deadline.
+  kRenderDeadline,
+  // arg: 1 if the buffer picked up a patch edit, index: active voices,
+  // value: load, render time over buffer duration.
+  kOverrun,
+  // arg: MIDI program number, index: generators of the program selected, or
+  // -1 if the patch bank doesn't have it, value: bank program number after
+  // bank select.
+  kProgramChange,
+};
+
+struct TraceRecord {
+  // The player's frame clock at the start of the block the event happened
+  // in, and the frame within the block.
+  uint64_t frame;
+  uint32_t offset;
+  // Which player, numbered in order of construction from 1; 0 for events from
+  // outside any player's render.
+  uint32_t player;
+  TraceEvent event;
+  uint8_t arg;
+  int32_t index;
+  float value;
+};
+
+class TraceRing {
+ public:
+  static constexpr size_t kCapacity = 4096;
+
+  static TraceRing &Get();
+
+  // Safe from any number of threads at once; never blocks or allocates.
+  // When the ring is full the record is dropped and counted.
+  void Record(TraceEvent event, uint8_t arg = 0, int32_t index = 0,
+              float value = 0.0f);
+
+  // Player and block frame stamped on subsequent records from the calling
+  // thread, with the offset back at 0. Set by every thread rendering a block.
+  static void SetFrame(uint32_t player, uint64_t frame) {
+    context_ = {frame, 0, player};
+  }
+
+  // Moves the calling thread's records `frames` further into the block for
+  // as long as it lives.
+  class Offset {
+   public:
+    explicit Offset(size_t frames) : frames_(frames) {
+      context_.offset += frames_;
+    }
+    ~Offset() { context_.offset -= frames_; }
+
+   private:
+    const uint32_t frames_;
+  };
+
+  // Single consumer: only one thread may pop at a time.
+  bool Pop(TraceRecord *record);
+
+  uint64_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+  static std::string Describe(const TraceRecord &record);
+
+ private:
+  TraceRing();
+
+  // Bounded queue after Dmitry Vyukov's: each slot's sequence number says
+  // whether it's free for the producer at `pos` or full for the consumer.
+  struct Slot {
+    std::atomic<uint64_t> sequence;
+    TraceRecord record;
+  };
+
+  struct Context {
+    uint64_t frame;
+    uint32_t offset;
+    uint32_t player;
+  };
+  static thread_local Context context_;
+
+  std::array<Slot, kCapacity> slots_;
+  alignas(64) std::atomic<uint64_t> head_{0};
+  alignas(64) std::atomic<uint64_t> tail_{0};
+  std::atomic<uint64_t> dropped_{0};
+};
+
+// Periodically empties TraceRing::Get() to glog, or to `path` when given.
+class TraceDrain {
+ public:
+  explicit TraceDrain(const std::string &path = "");
+  ~TraceDrain();
+
+  void Start();
+  void Stop();
+
+ private:
+  void Drain();
+
+  std::ofstream file_;
+  std::atomic_bool running_ = false;
+  std::thread drain_thread_;
+  uint64_t reported_dropped_ = 0;
+};
+
+#ifdef MODFM_ENABLE_TRACE
+#define MODFM_TRACE(...) TraceRing::Get().Record(__VA_ARGS__)
+#define MODFM_TRACE_FRAME(player, frame) TraceRing::SetFrame(player, frame)
+#define MODFM_TRACE_CONCAT_(a, b) a##b
+#define MODFM_TRACE_CONCAT(a, b) MODFM_TRACE_CONCAT_(a, b)
+// Offsets records from the calling thread by `frames` to the end of the
+// enclosing scope.
+#define MODFM_TRACE_OFFSET(frames) \
+  TraceRing::Offset MODFM_TRACE_CONCAT(trace_offset_, __LINE__)(frames)
+#else
+#define MODFM_TRACE(...) \
+  do {                   \
+  } while (0)
+#define MODFM_TRACE_FRAME(player, frame) \
+  do {                                   \
+  } while (0)
+#define MODFM_TRACE_OFFSET(frames) \
+  do {                             \
+  } while (0)
+#endif
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "patch.h"
+
+// Single cycle tables of the ModFM waveform for generators whose carrier (C)
+// and modulator (C * M) are integer multiples of the base frequency. Over one
+// base period the output then only depends on K (and the R/S shape), so it can
+// be sampled ahead of time on a grid of K values and played back with phase
+// and K interpolation instead of evaluating the transcendental functions.
+//
+// Every K row is stored as a set of octave spaced mip levels, each band
+// limited to the harmonics that stay below Nyquist for the base frequencies it
+// is selected for. Interpolation error is around -50 dB relative to the
+// signal for drawbar style shapes, which is why Generator doesn't use tables
+// at Oscillator::Quality::kReference.
+class Wavetable {
+ public:
+  static constexpr int kTableBits = 10;
+  static constexpr size_t kTableSize = 1 << kTableBits;
+  // Highest harmonic held by mip level 0; level n holds kMaxHarmonic >> n.
+  static constexpr int kMaxHarmonic = kTableSize / 2 - 1;
+  static constexpr int kNumMipLevels = kTableBits;
+  // Intervals in the K grid; there are kKSteps + 1 rows.
+  static constexpr int kKSteps = 16;
+
+  // Returns a table for `osc` covering K values up to `max_k`, or nullptr if
+  // the oscillator's ratios aren't integers or its spectrum doesn't fit in the
+  // table. Tables are shared between callers asking for the same shape;
+  // A does not take part in the shape.
+  static std::shared_ptr<const Wavetable> Get(const GeneratorPatch::Osc &osc,
+                                              float max_k);
+
+  float max_k() const { return max_k_; }
+
+  // Mip level to play back at `base_freq`.
+  int MipLevelFor(float base_freq, float sample_rate) const;
+
+  // Waveform value at `phase` (32 bit fixed point turns of the base period)
+  // and `k`, interpolated linearly along both.
+  float Sample(int mip_level, uint32_t phase, float k) const {
+    constexpr int kFracBits = 32 - kTableBits;
+    float k_pos = k * k_scale_;
+    k_pos = k_pos < 0 ? 0 : (k_pos > kKSteps ? kKSteps : k_pos);
+    int k_step = k_pos < kKSteps ? static_cast<int>(k_pos) : kKSteps - 1;
+    float k_frac = k_pos - k_step;
+
+    uint32_t index = phase >> kFracBits;
+    float frac = (phase & ((1u << kFracBits) - 1)) * (1.0f / (1u << kFracBits));
+
+    const float *lo = &samples_[RowOffset(mip_level, k_step)];
+    const float *hi = lo + kTableSize + 1;
+    float a = lo[index] + frac * (lo[index + 1] - lo[index]);
+    float b = hi[index] + frac * (hi[index + 1] - hi[index]);
+    return a + k_frac * (b - a);
+  }
+
+  // Use Get().
+  Wavetable(const GeneratorPatch::Osc &osc, float max_k);
+
+ private:
+  size_t RowOffset(int mip_level, int k_step) const {
+    return ((mip_level * (kKSteps + 1)) + k_step) * (kTableSize + 1);
+  }
+
+  float max_k_;
+  float k_scale_;
+  // [mip level][k step][phase], with a guard point per row.
+  std::vector<float> samples_;
+};
@@ -0,0 +1,88 @@
+#include "allocation_guard.h"
+
+#ifdef MODFM_ALLOCATION_GUARD
+
+#include <glog/logging.h>
+
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+
+namespace {
+
+thread_local int guard_depth = 0;
+
+void *Allocate(std::size_t size, std::size_t alignment) {
+  if (guard_depth > 0) {
+    // Logging allocates too.
+    guard_depth = 0;
+    LOG(FATAL) << "Heap allocation of " << size
+               << " bytes inside a ScopedAllocationGuard";
+  }
+  if (size == 0) size = 1;
+  void *p;
+  if (alignment <= alignof(std::max_align_t)) {
+    p = std::malloc(size);
+  } else {
+    size = (size + alignment - 1) & ~(alignment - 1);
+    p = std::aligned_alloc(alignment, size);
+  }
+  return p;
+}
+
+}  // namespace
+
+ScopedAllocationGuard::ScopedAllocationGuard() { guard_depth++; }
+
+ScopedAllocationGuard::~ScopedAllocationGuard() { guard_depth--; }
+
+void *operator new(std::size_t size) {
+  void *p = Allocate(size, alignof(std::max_align_t));
+  if (!p) throw std::bad_alloc();
+  return p;
+}
+
+void *operator new[](std::size_t size) { return operator new(size); }
+
+void *operator new(std::size_t size, std::align_val_t alignment) {
+  void *p = Allocate(size, static_cast<std::size_t>(alignment));
+  if (!p) throw std::bad_alloc();
+  return p;
+}
+
+void *operator new[](std::size_t size, std::align_val_t alignment) {
+  return operator new(size, alignment);
+}
+
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept {
+  return Allocate(size, alignof(std::max_align_t));
+}
+
+void *operator new[](std::size_t size, const std::nothrow_t &) noexcept {
+  return Allocate(size, alignof(std::max_align_t));
+}
+
+void *operator new(std::size_t size, std::align_val_t alignment,
+                   const std::nothrow_t &) noexcept {
+  return Allocate(size, static_cast<std::size_t>(alignment));
+}
+
+void *operator new[](std::size_t size, std::align_val_t alignment,
+                     const std::nothrow_t &) noexcept {
+  return Allocate(size, static_cast<std::size_t>(alignment));
+}
+
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete[](void *p) noexcept { std::free(p); }
+void operator delete(void *p, std::size_t) noexcept { std::free(p); }
+void operator delete[](void *p, std::size_t) noexcept { std::free(p); }
+void operator delete(void *p, std::align_val_t) noexcept { std::free(p); }
+void operator delete[](void *p, std::align_val_t) noexcept { std::free(p); }
+void operator delete(void *p, std::size_t, std::align_val_t) noexcept {
+  std::free(p);
+}
+void operator delete[](void *p, std::size_t, std::align_val_t) noexcept {
+  std::free(p);
+}
+
+#endif  // MODFM_ALLOCATION_GUARD
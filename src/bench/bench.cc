@@ -0,0 +1,157 @@
+// Microbenchmarks for the render path, from a single oscillator up to a whole
+// player. Every benchmark reports per_sample, the time taken per output
+// sample (shown in ns, in seconds in JSON); the player benchmarks also
+// report realtime_polyphony, the number of voices one core could keep up with
+// at that block size and generator count.
+//
+//   modfm_bench --benchmark_format=json --benchmark_out=results.json
+//
+// The matrix is fixed so results from different revisions line up.
+
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <vector>
+
+#include "envgen.h"
+#include "oscillator.h"
+#include "player.h"
+
+namespace {
+
+constexpr int kSampleRate = 44100;
+
+const std::vector<int64_t> kBlockSizes = {32, 64, 256, 1024, 4096};
+const std::vector<int64_t> kVoiceCounts = {8, 32, 128};
+const std::vector<int64_t> kGeneratorCounts = {1, 4, 16};
+
+// Seconds per output sample.
+benchmark::Counter PerSample(int64_t samples_per_iteration) {
+  return benchmark::Counter(samples_per_iteration,
+                            benchmark::Counter::kIsIterationInvariantRate |
+                                benchmark::Counter::kInvert);
+}
+
+// Ratios just off integers, so generators evaluate the formula rather than
+// play back a wavetable.
+GeneratorPatch::Osc BenchOsc(int g) {
+  return {(g + 1) * 1.01f, 0.5f, 1.5f, 2.0f, 1.0f, 0.3f};
+}
+
+void BM_Oscillator(benchmark::State &state) {
+  const size_t frames = state.range(0);
+  const auto quality = static_cast<Oscillator::Quality>(state.range(1));
+  Oscillator oscillator;
+  oscillator.SetQuality(quality);
+  std::vector<float> out(frames);
+  std::vector<float> level_a(frames, 0.5f), level_k(frames, 2.0f);
+  for (auto _ : state) {
+    oscillator.Perform(frames, kSampleRate, out.data(), 220.0f, BenchOsc(0),
+                       level_a.data(), level_k.data());
+    benchmark::DoNotOptimize(out.data());
+  }
+  state.SetLabel(Oscillator::QualityName(quality));
+  state.counters["per_sample"] = PerSample(frames);
+}
+BENCHMARK(BM_Oscillator)
+    ->ArgsProduct({kBlockSizes,
+                   {static_cast<int64_t>(Oscillator::Quality::kReference),
+                    static_cast<int64_t>(Oscillator::Quality::kPolynomial),
+                    static_cast<int64_t>(Oscillator::Quality::kTable)}})
+    ->ArgNames({"frames", "quality"});
+
+void BM_Envelope(benchmark::State &state) {
+  const size_t frames = state.range(0);
+  // Long stages, so every block is inside a segment like most blocks are.
+  const auto program =
+      EnvelopeProgram::FromEnvelope({10.0f, 1.0f, 10.0f, 0.5f, 1.0f});
+  EnvelopeGenerator envelope(kSampleRate);
+  std::vector<float> out(frames);
+  envelope.NoteOn(program);
+  size_t rendered = 0;
+  for (auto _ : state) {
+    // Start over before the sustain, where rendering is just a fill.
+    if (rendered >= 15 * kSampleRate) {
+      envelope.NoteOn(program);
+      rendered = 0;
+    }
+    envelope.Render(program, 1.0f, out.data(), frames);
+    rendered += frames;
+    benchmark::DoNotOptimize(out.data());
+  }
+  state.counters["per_sample"] = PerSample(frames);
+}
+BENCHMARK(BM_Envelope)->ArgsProduct({kBlockSizes})->ArgNames({"frames"});
+
+void BM_Generator(benchmark::State &state) {
+  const size_t frames = state.range(0);
+  Patch patch;
+  patch.AddGenerator()->Update(BenchOsc(0), std::nullopt, std::nullopt);
+  auto snapshot = patch.snapshot();
+  const auto &gp = snapshot->generators[0];
+  Generator generator(kSampleRate);
+  ControllerValues controllers{};
+  generator.NoteOn(gp, 0, 100, 60);
+  std::vector<float> out(frames);
+  for (auto _ : state) {
+    generator.Perform(gp, out.data(), 261.6f, controllers, frames);
+    benchmark::DoNotOptimize(out.data());
+  }
+  state.counters["per_sample"] = PerSample(frames);
+}
+BENCHMARK(BM_Generator)->ArgsProduct({kBlockSizes})->ArgNames({"frames"});
+
+// Every voice holding a note in its sustain, rendered on one thread. Notes
+// stay within three octaves from C3 whatever the voice count, and
+// oversampling is off, so the cost per voice doesn't depend on how many there
+// are. A player holds one voice per note, so voices past the range go to
+// further players.
+void BM_Player(benchmark::State &state) {
+  constexpr int kLowestNote = 48;
+  constexpr int kNotes = 36;
+  const size_t frames = state.range(0);
+  const int num_voices = state.range(1);
+  const int num_generators = state.range(2);
+  Patch patch;
+  for (int g = 0; g < num_generators; g++)
+    patch.AddGenerator()->Update(BenchOsc(g), std::nullopt, std::nullopt);
+  std::vector<std::unique_ptr<Player>> players;
+  for (int first = 0; first < num_voices; first += kNotes) {
+    const int voices = std::min(kNotes, num_voices - first);
+    players.push_back(
+        std::make_unique<Player>(&patch, voices, kSampleRate, frames, 1));
+    players.back()->SetDeadline(0);
+    players.back()->SetMaxOversampling(1);
+    for (int v = 0; v < voices; v++)
+      players.back()->NoteOn(0, 100, kLowestNote + v);
+  }
+  std::vector<float> out(frames);
+  // Past the attack and decay.
+  for (size_t rendered = 0; rendered < kSampleRate; rendered += frames) {
+    for (auto &player : players) player->Perform(nullptr, out.data(), frames);
+  }
+
+  const auto start = std::chrono::steady_clock::now();
+  for (auto _ : state) {
+    for (auto &player : players) player->Perform(nullptr, out.data(), frames);
+    benchmark::DoNotOptimize(out.data());
+  }
+  const std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  state.counters["per_sample"] = PerSample(frames);
+  // Voices times seconds of audio rendered per second of wall time.
+  const double audio_seconds =
+      static_cast<double>(state.iterations()) * frames / kSampleRate;
+  state.counters["realtime_polyphony"] =
+      num_voices * audio_seconds / elapsed.count();
+}
+BENCHMARK(BM_Player)
+    ->ArgsProduct({kBlockSizes, kVoiceCounts, kGeneratorCounts})
+    ->ArgNames({"frames", "voices", "generators"})
+    ->Unit(benchmark::kMicrosecond);
+
+}  // namespace
+
+BENCHMARK_MAIN();
@@ -0,0 +1,138 @@
+#include "decimator.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <numbers>
+
+namespace {
+
+// Kaiser window shape; about 70 dB of stopband attenuation.
+constexpr double kKaiserBeta = 7.0;
+
+double BesselI0(double x) {
+  double sum = 1.0, term = 1.0;
+  for (int k = 1; k < 32; k++) {
+    term *= (x / (2.0 * k)) * (x / (2.0 * k));
+    sum += term;
+  }
+  return sum;
+}
+
+// The nonzero coefficients either side of the centre tap, nearest first,
+// scaled so that together with the centre's 0.5 they pass DC at unity.
+template <int Taps>
+std::array<float, (Taps + 1) / 4> DesignHalfband() {
+  constexpr int kCentre = (Taps - 1) / 2;
+  std::array<double, (Taps + 1) / 4> h;
+  double sum = 0.0;
+  for (size_t i = 0; i < h.size(); i++) {
+    const int k = 2 * i + 1;
+    const double x = std::numbers::pi * k / 2.0;
+    const double r = static_cast<double>(k) / kCentre;
+    const double window =
+        BesselI0(kKaiserBeta * std::sqrt(1.0 - r * r)) / BesselI0(kKaiserBeta);
+    h[i] = 0.5 * std::sin(x) / x * window;
+    sum += 2.0 * h[i];
+  }
+  std::array<float, (Taps + 1) / 4> coefficients;
+  for (size_t i = 0; i < h.size(); i++)
+    coefficients[i] = static_cast<float>(h[i] * 0.5 / sum);
+  return coefficients;
+}
+
+template <int Taps>
+const std::array<float, (Taps + 1) / 4> kHalfband = DesignHalfband<Taps>();
+
+}  // namespace
+
+template <int Taps>
+void HalfbandDecimator<Taps>::Process(const float in[], float out[],
+                                      size_t frames) {
+  constexpr int kCentre = (Taps - 1) / 2;
+  const auto &h = kHalfband<Taps>;
+  // The history followed by this pass's input, oldest first.
+  float x[Taps - 1 + 2 * kMaxFrames];
+  while (frames > 0) {
+    const size_t n = std::min(frames, kMaxFrames);
+    std::memcpy(x, history_.data(), sizeof(history_));
+    std::memcpy(x + Taps - 1, in, 2 * n * sizeof(float));
+    for (size_t i = 0; i < n; i++) {
+      // Output i is the filter over x[2i + 1] to x[2i + Taps].
+      const float *centre = x + 2 * i + 1 + kCentre;
+      float sum = 0.5f * centre[0];
+      for (size_t k = 0; k < h.size(); k++)
+        sum += h[k] * (centre[-1 - 2 * int(k)] + centre[1 + 2 * k]);
+      out[i] = sum;
+    }
+    std::memcpy(history_.data(), x + 2 * n, sizeof(history_));
+    in += 2 * n;
+    out += n;
+    frames -= n;
+  }
+}
+
+template class HalfbandDecimator<27>;
+template class HalfbandDecimator<47>;
+
+// Output frame i is centred on input sample factor * i - 23 at 2x and
+// factor * i - 57 at 4x, counting the sample of delay in front; centred on
+// the last sample of input frame i - Delay(factor) is whole frames.
+static_assert((2 * Decimator::Delay(2) - 1) == 23);
+static_assert((4 * Decimator::Delay(4) - 3) == 57);
+
+void Decimator::Process(int factor, const float in[], float out[],
+                        size_t frames) {
+  if (factor == 1) {
+    if (in != out) std::memcpy(out, in, frames * sizeof(float));
+    Pad(1, out, frames);
+    return;
+  }
+  constexpr size_t kMaxFrames = HalfbandDecimator<47>::kMaxFrames;
+  float late[kMaxFactor * kMaxFrames];
+  float half[2 * kMaxFrames];
+  while (frames > 0) {
+    const size_t n = std::min(frames, kMaxFrames);
+    const size_t samples = factor * n;
+    late[0] = carry_;
+    std::memcpy(late + 1, in, (samples - 1) * sizeof(float));
+    carry_ = in[samples - 1];
+    if (factor == 4) {
+      from_4x_.Process(late, half, 2 * n);
+      from_2x_.Process(half, out, n);
+    } else {
+      from_2x_.Process(late, out, n);
+    }
+    Pad(factor, out, n);
+    in += samples;
+    out += n;
+    frames -= n;
+  }
+}
+
+void Decimator::SetLatency(int latency) {
+  latency_ = std::clamp(latency, 0, kMaxDelay);
+  pad_frames_ = 0;
+}
+
+void Decimator::Pad(int factor, float buffer[], size_t frames) {
+  const int pad = std::max(latency_ - Delay(factor), 0);
+  if (pad != pad_frames_) {
+    padding_.fill(0.0f);
+    pad_frames_ = pad;
+    pad_pos_ = 0;
+  }
+  if (pad == 0) return;
+  for (size_t i = 0; i < frames; i++) {
+    std::swap(buffer[i], padding_[pad_pos_]);
+    if (++pad_pos_ == pad) pad_pos_ = 0;
+  }
+}
+
+void Decimator::Reset() {
+  from_4x_.Reset();
+  from_2x_.Reset();
+  carry_ = 0.0f;
+  padding_.fill(0.0f);
+  pad_pos_ = 0;
+}
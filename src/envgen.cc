@@ -1,30 +1,146 @@
 #include "envgen.h"
 
-#include <glog/logging.h>
+#include <algorithm>
 
-constexpr const char *kStageLabels[]{"OFF", "ATTACK", "DECAY", "SUSTAIN",
-                                     "RELEASE"};
+#include "trace.h"
 
 // originally based on
 // http://www.martin-finke.de/blog/articles/audio-plugins-011-envelopes/
-// TODO: too much branching in loops, need to be able to set levels (not just
-// rates), more stages, velocity & aftertouch
+// TODO: velocity & aftertouch
 
-float EnvelopeGenerator::NextSample(const GeneratorPatch::Envelope &env) {
-  if (stage_ != ENVELOPE_STAGE_OFF && stage_ != ENVELOPE_STAGE_SUSTAIN) {
-    if (current_sample_index_ == next_stage_sample_index_) {
-      auto new_stage =
-          static_cast<EnvelopeStage>((stage_ + 1) % kNumEnvelopeStages);
-      LOG(INFO) << current_sample_index_ << ": " << kStageLabels[stage_]
-                << " => " << kStageLabels[new_stage];
-      EnterStage(new_stage, env);
-    }
+EnvelopeProgram EnvelopeProgram::FromEnvelope(
+    const GeneratorPatch::Envelope &env) {
+  EnvelopeProgram program;
+  program.segments[0] = {env.A_L, env.A_R};
+  program.segments[1] = {env.S_L, env.D_R};
+  const int extra = std::clamp<int>(env.num_segments, 0,
+                                    GeneratorPatch::Envelope::kMaxSegments);
+  for (int i = 0; i < extra; i++) program.segments[2 + i] = env.segments[i];
+  program.num_segments = 2 + extra;
+  for (int i = 0; i < program.num_segments; i++)
+    program.segments[i].time = std::fmax(program.segments[i].time, 0.0f);
+  if (env.sustain >= 0 && env.sustain < program.num_segments)
+    program.sustain = env.sustain;
+  if (env.loop_start >= 0 && env.loop_start <= env.loop_end &&
+      env.loop_end < program.num_segments) {
+    program.loop_start = env.loop_start;
+    program.loop_end = env.loop_end;
+  }
+  program.release_time = std::fmax(env.R_R, 0.0f);
+  return program;
+}
+
+void EnvelopeGenerator::NoteOn(const EnvelopeProgram &program) {
+  EnterSegment(0, minimum_level_, program);
+}
+
+void EnvelopeGenerator::NoteOff(const EnvelopeProgram &program) {
+  if (!Playing()) return;
+  // We could go from any segment to RELEASE, so we're not changing
+  // current_level_ here.
+  stage_ = ENVELOPE_STAGE_RELEASE;
+  current_sample_index_ = 0;
+  next_stage_sample_index_ = program.release_time * sample_rate_;
+  coefficient_ = CalculateCoefficient(current_level_, minimum_level_,
+                                      next_stage_sample_index_);
+  MODFM_TRACE(TraceEvent::kEnvelopeStage, stage_, segment_, current_level_);
+}
+
+void EnvelopeGenerator::Stop() {
+  stage_ = ENVELOPE_STAGE_OFF;
+  current_level_ = 0.0;
+  coefficient_ = 1.0f;
+}
+
+float EnvelopeGenerator::Ceiling(const EnvelopeProgram &program) const {
+  switch (stage_) {
+    case ENVELOPE_STAGE_OFF:
+      return 0.0f;
+    case ENVELOPE_STAGE_SUSTAIN:
+    case ENVELOPE_STAGE_RELEASE:
+      // Only ever held or falling from here.
+      return current_level_;
+    default:
+      break;
+  }
+  // Loops can come back around to any segment.
+  float ceiling = current_level_;
+  for (int i = 0; i < program.num_segments; i++)
+    ceiling = std::max(ceiling, program.segments[i].level);
+  return ceiling;
+}
+
+float EnvelopeGenerator::NextSample(const EnvelopeProgram &program) {
+  // Zero length segments end as soon as they start.
+  while (Running() && current_sample_index_ == next_stage_sample_index_)
+    EndSegment(program);
+  if (Running()) {
     current_level_ *= coefficient_;
     current_sample_index_++;
   }
   return current_level_;
 }
 
+void EnvelopeGenerator::Render(const EnvelopeProgram &program, float scale,
+                               float out[], size_t frames) {
+  constexpr size_t kLanes = 8;
+  size_t i = 0;
+  while (i < frames) {
+    if (!Running()) {
+      std::fill(out + i, out + frames, scale * current_level_);
+      return;
+    }
+    if (current_sample_index_ == next_stage_sample_index_) {
+      MODFM_TRACE_OFFSET(i);
+      EndSegment(program);
+      continue;
+    }
+
+    // Within a segment level[n] = level[0] * coefficient^n, so compute eight
+    // independent lanes at a time instead of one long multiply chain.
+    size_t n = std::min(frames - i,
+                        next_stage_sample_index_ - current_sample_index_);
+    float level = current_level_;
+    size_t j = 0;
+    if (n >= kLanes) {
+      float powers[kLanes];
+      powers[0] = coefficient_;
+      for (size_t l = 1; l < kLanes; l++) {
+        powers[l] = powers[l - 1] * coefficient_;
+      }
+      for (; j + kLanes <= n; j += kLanes) {
+        for (size_t l = 0; l < kLanes; l++) {
+          out[i + j + l] = scale * level * powers[l];
+        }
+        level *= powers[kLanes - 1];
+      }
+    }
+    for (; j < n; j++) {
+      level *= coefficient_;
+      out[i + j] = scale * level;
+    }
+    current_level_ = level;
+    current_sample_index_ += n;
+    i += n;
+  }
+}
+
+void EnvelopeGenerator::Skip(const EnvelopeProgram &program, size_t frames) {
+  [[maybe_unused]] const size_t total = frames;
+  while (frames > 0 && Running()) {
+    if (current_sample_index_ == next_stage_sample_index_) {
+      MODFM_TRACE_OFFSET(total - frames);
+      EndSegment(program);
+      continue;
+    }
+    const size_t n =
+        std::min(frames, next_stage_sample_index_ - current_sample_index_);
+    current_level_ *= std::pow(coefficient_, static_cast<float>(n));
+    current_sample_index_ += n;
+    frames -= n;
+  }
+}
+
 float EnvelopeGenerator::CalculateCoefficient(float start_level,
                                               float end_level,
                                               size_t length_in_samples) const {
@@ -32,47 +148,57 @@ float EnvelopeGenerator::CalculateCoefficient(float start_level,
                     ((float)length_in_samples);
 }
 
-void EnvelopeGenerator::EnterStage(EnvelopeStage new_stage,
-                                   const GeneratorPatch::Envelope &envelope) {
-  const float stage_rates_[]{0.0f, envelope.A_R, envelope.D_R, envelope.S_L,
-                             envelope.R_R};
-  stage_ = new_stage;
-  current_sample_index_ = 0;
-  if (stage_ != ENVELOPE_STAGE_OFF && stage_ != ENVELOPE_STAGE_SUSTAIN) {
-    next_stage_sample_index_ = stage_rates_[stage_] * sample_rate_;
+void EnvelopeGenerator::EndSegment(const EnvelopeProgram &program) {
+  if (stage_ == ENVELOPE_STAGE_RELEASE) {
+    Stop();
+    MODFM_TRACE(TraceEvent::kEnvelopeStage, stage_, segment_, current_level_);
+    return;
   }
-  LOG(INFO) << current_sample_index_ << " : Stage: " << kStageLabels[stage_]
-            << " until " << stage_rates_[stage_];
-  switch (new_stage) {
-    case ENVELOPE_STAGE_OFF:
-      current_level_ = 0.0;
-      coefficient_ = 1.0f;
-      break;
-    case ENVELOPE_STAGE_ATTACK:
-      current_level_ = minimum_level_;
-      coefficient_ = CalculateCoefficient(current_level_, envelope.A_L,
-                                          next_stage_sample_index_);
-      break;
-    case ENVELOPE_STAGE_DECAY:
-      current_level_ = envelope.A_L;
-      coefficient_ = CalculateCoefficient(
-          current_level_,
-          std::fmax(stage_rates_[ENVELOPE_STAGE_SUSTAIN], minimum_level_),
-          next_stage_sample_index_);
-      break;
-    case ENVELOPE_STAGE_SUSTAIN:
-      current_level_ = stage_rates_[ENVELOPE_STAGE_SUSTAIN];
-      coefficient_ = 1.0f;
-      break;
-    case ENVELOPE_STAGE_RELEASE:
-      // We could go from ATTACK/DECAY to RELEASE,
-      // so we're not changing currentLevel here.
-      coefficient_ = CalculateCoefficient(current_level_, minimum_level_,
-                                          next_stage_sample_index_);
-      break;
-    default:
-      break;
+  if (segment_ == program.loop_end && program.loop_start >= 0 &&
+      program.loop_start <= program.loop_end) {
+    // A loop that takes no time would never let go; hold instead.
+    size_t loop_samples = 0;
+    for (int i = program.loop_start; i <= program.loop_end; i++)
+      loop_samples += static_cast<size_t>(program.segments[i].time *
+                                          sample_rate_);
+    if (loop_samples == 0) {
+      Hold(program.segments[segment_].level);
+      return;
+    }
+    EnterSegment(program.loop_start, program.segments[segment_].level,
+                 program);
+    return;
+  }
+  if (segment_ == program.sustain || segment_ + 1 >= program.num_segments) {
+    Hold(program.segments[segment_].level);
+    return;
   }
+  EnterSegment(segment_ + 1, program.segments[segment_].level, program);
+}
+
+void EnvelopeGenerator::EnterSegment(int segment, float start_level,
+                                     const EnvelopeProgram &program) {
+  if (segment >= program.num_segments) {
+    Hold(start_level);
+    return;
+  }
+  current_level_ = std::fmax(start_level, minimum_level_);
+  const auto &s = program.segments[segment];
+  segment_ = segment;
+  stage_ = segment == 0 ? ENVELOPE_STAGE_ATTACK : ENVELOPE_STAGE_DECAY;
+  current_sample_index_ = 0;
+  next_stage_sample_index_ = s.time * sample_rate_;
+  coefficient_ =
+      CalculateCoefficient(current_level_, std::fmax(s.level, minimum_level_),
+                           next_stage_sample_index_);
+  MODFM_TRACE(TraceEvent::kEnvelopeStage, stage_, segment_, current_level_);
+}
+
+void EnvelopeGenerator::Hold(float level) {
+  stage_ = ENVELOPE_STAGE_SUSTAIN;
+  current_level_ = level;
+  coefficient_ = 1.0f;
+  MODFM_TRACE(TraceEvent::kEnvelopeStage, stage_, segment_, current_level_);
 }
 
 void EnvelopeGenerator::SetSampleRate(float newSampleRate) {
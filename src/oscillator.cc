@@ -1,27 +1,41 @@
 #include "oscillator.h"
 
+#include <algorithm>
+#include <atomic>
 #include <cmath>
 #include <numbers>
+#include <utility>
+
+#include "oscillator_kernels.h"
+#include "wavetable.h"
 
 namespace {
 constexpr std::complex<float> kCpi = std::numbers::pi;
-}  // namespace
 
-void Oscillator::Perform(size_t buffer_size, uint16_t sample_rate,
-                         std::complex<float> buffer[], float base_freq,
-                         const float level_a[], const float level_c[],
-                         const float level_m[], const float level_r[],
-                         const float level_s[], const float level_k[]) {
-  std::complex<float> c_sample_rate = sample_rate;
-  for (size_t i = 0; i < buffer_size; i++) {
-    std::complex<float> freq = base_freq * level_c[i];
+constexpr float kTwoPi = 2.0f * std::numbers::pi_v<float>;
+
+double Wrap(double phase) { return phase - std::floor(phase); }
+
+// Per frame, in 32 bit fixed point turns of the base period, so wrapping is
+// free.
+uint32_t TableIncrement(float base_freq, int sample_rate) {
+  return static_cast<uint32_t>(static_cast<double>(base_freq) / sample_rate *
+                               0x1p32);
+}
+
+void ModFMClockScalar(const ModFMKernelArgs &args) {
+  std::complex<float> c_sample_rate = args.sample_rate;
+  float x = args.x;
+  for (size_t i = 0; i < args.frames; i++) {
+    std::complex<float> freq = args.base_freq * args.c;
     std::complex<float> omega_c = 2.0f * kCpi * freq;
-    std::complex<float> omega_m = 2.0f * kCpi * (level_m[i] * freq);
-    std::complex<float> S = std::complex<float>(0, level_s[i]);
-    std::complex<float> A = std::complex<float>(level_a[i]);
-    std::complex<float> K = std::complex<float>(0, level_k[i]);
-    x_++;
-    std::complex<float> t = (x_ / c_sample_rate);
+    std::complex<float> omega_m = 2.0f * kCpi * (args.m * freq);
+    std::complex<float> S = std::complex<float>(0, args.s + args.ds * i);
+    float r = args.r + args.dr * i;
+    std::complex<float> A = std::complex<float>(args.level_a[i]);
+    std::complex<float> K = std::complex<float>(0, args.level_k[i]);
+    x++;
+    std::complex<float> t = (x / c_sample_rate);
     std::complex<float> omega_ct = t * omega_c;
     std::complex<float> omega_mt = t * omega_m;
 
@@ -33,7 +47,304 @@ void Oscillator::Perform(size_t buffer_size, uint16_t sample_rate,
     // https://mural.maynoothuniversity.ie/4697/1/JAES_V58_6_PG459hirez.pdf
     //    buffer[i] = patch.A * (std::exp(K * std::cos(omega_mt)) *
     //    std::cos(omega_ct));
-    buffer[i] = (A * (std::exp(level_r[i] * K * std::cos(omega_mt)) *
-                      std::cos(omega_ct + S * K * std::sin(omega_mt))));
+    args.out[i] += (A * (std::exp(r * K * std::cos(omega_mt)) *
+                         std::cos(omega_ct + S * K * std::sin(omega_mt))))
+                       .real();
+  }
+}
+
+std::array<float, kSineTableSize + 1> BuildSineTable() {
+  std::array<float, kSineTableSize + 1> table;
+  for (int i = 0; i <= kSineTableSize; i++) {
+    table[i] = static_cast<float>(
+        std::sin(2.0 * std::numbers::pi * i / kSineTableSize));
+  }
+  return table;
+}
+
+// Trig policies for ModFMScalar, in turns like the vector kernels.
+struct LibmTrig {
+  static float Sin(float t) { return std::sin(kTwoPi * t); }
+  static float Cos(float t) { return std::cos(kTwoPi * t); }
+};
+
+struct TableTrig {
+  // Works in 32 bit fixed point turns so that wrapping is free.
+  static float Sin(float t) {
+    constexpr int kFracBits = 32 - kSineTableBits;
+    auto phase = static_cast<uint32_t>(static_cast<int64_t>(t * 0x1p32f));
+    uint32_t index = phase >> kFracBits;
+    float frac = (phase & ((1u << kFracBits) - 1)) * (1.0f / (1u << kFracBits));
+    return kSineTable[index] +
+           frac * (kSineTable[index + 1] - kSineTable[index]);
+  }
+  static float Cos(float t) { return Sin(t + 0.25f); }
+};
+
+// Real form of the above, for the phase accumulator and phasor sources.
+template <typename Trig>
+void ModFMScalar(const ModFMKernelArgs &args) {
+  constexpr float kInvTwoPi = 0.5f / std::numbers::pi_v<float>;
+  for (size_t i = 0; i < args.frames; i++) {
+    float SK = (args.s + args.ds * i) * args.level_k[i] * kInvTwoPi;
+    float carrier, cos_m;
+    if (args.source == ModFMKernelArgs::Source::kPhasors) {
+      float deviation = SK * args.sin_m[i];
+      cos_m = args.cos_m[i];
+      carrier = args.cos_c[i] * Trig::Cos(deviation) +
+                args.sin_c[i] * Trig::Sin(deviation);
+    } else {
+      cos_m = Trig::Cos(args.phase_m[i]);
+      carrier = Trig::Cos(args.phase_c[i] - SK * Trig::Sin(args.phase_m[i]));
+    }
+    float index = (args.r + args.dr * i) * args.level_k[i] * cos_m * kInvTwoPi;
+    args.out[i] += args.level_a[i] * carrier * Trig::Cos(index);
+  }
+}
+
+void ModFMKernelScalar(const ModFMKernelArgs &args, bool table) {
+  if (table) {
+    ModFMScalar<TableTrig>(args);
+  } else if (args.source == ModFMKernelArgs::Source::kClock) {
+    ModFMClockScalar(args);
+  } else {
+    ModFMScalar<LibmTrig>(args);
+  }
+}
+
+Oscillator::ISA DetectISA() {
+#if defined(MODFM_HAVE_X86_KERNELS)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) return Oscillator::ISA::kAVX512;
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+    return Oscillator::ISA::kAVX2;
+  return Oscillator::ISA::kSSE2;
+#else
+  return Oscillator::ISA::kScalar;
+#endif
+}
+
+const Oscillator::ISA kSupportedISA = DetectISA();
+std::atomic<Oscillator::ISA> active_isa{kSupportedISA};
+
+void Dispatch(const ModFMKernelArgs &args, Oscillator::Quality quality) {
+  if (quality == Oscillator::Quality::kReference) {
+    ModFMKernelScalar(args, false);
+    return;
+  }
+  switch (active_isa.load(std::memory_order_relaxed)) {
+#if defined(MODFM_HAVE_X86_KERNELS)
+    case Oscillator::ISA::kAVX512:
+      ModFMKernelAVX512(args);
+      break;
+    case Oscillator::ISA::kAVX2:
+      ModFMKernelAVX2(args);
+      break;
+    case Oscillator::ISA::kSSE2:
+      ModFMKernelSSE2(args);
+      break;
+#endif
+    default:
+      ModFMKernelScalar(args, args.table);
+      break;
+  }
+}
+
+}  // namespace
+
+const std::array<float, kSineTableSize + 1> kSineTable = BuildSineTable();
+
+void Oscillator::Perform(size_t buffer_size, int sample_rate,
+                         float buffer[], float base_freq,
+                         const GeneratorPatch::Osc &osc,
+                         const float level_a[], const float level_k[]) {
+  Perform(buffer_size, sample_rate, buffer, base_freq, osc, {}, level_a,
+          level_k);
+}
+
+void Oscillator::Perform(size_t buffer_size, int sample_rate,
+                         float buffer[], float base_freq,
+                         const GeneratorPatch::Osc &osc,
+                         const GeneratorPatch::Osc &step,
+                         const float level_a[], const float level_k[]) {
+  ModFMKernelArgs args{};
+  args.table = quality_ == Quality::kTable && ActiveISA() == ISA::kScalar;
+  args.dr = step.R;
+  args.ds = step.S;
+  args.sample_rate = sample_rate;
+  args.base_freq = base_freq;
+
+  if (phase_mode_ == PhaseMode::kSampleClock) {
+    // Ratios are applied to absolute time here, so they can only step.
+    const float mid = buffer_size * 0.5f;
+    args.c = osc.C + step.C * mid;
+    args.m = osc.M + step.M * mid;
+    args.r = osc.R;
+    args.s = osc.S;
+    args.frames = buffer_size;
+    args.source = ModFMKernelArgs::Source::kClock;
+    args.x = x_;
+    args.level_a = level_a;
+    args.level_k = level_k;
+    args.out = buffer;
+    Dispatch(args, quality_);
+    x_ += buffer_size;
+    return;
+  }
+
+  if (on_table_) {
+    const double turns = table_phase_ * 0x1p-32;
+    phase_c_ = Wrap(osc.C * turns);
+    phase_m_ = Wrap(osc.C * osc.M * turns);
+    on_table_ = false;
+  }
+  table_phase_ += static_cast<uint32_t>(buffer_size) *
+                  TableIncrement(base_freq, sample_rate);
+
+  // Phase increment at `frame`, a fraction of the way through the buffer.
+  auto increments = [&](float frame) {
+    const double inc_c = static_cast<double>(base_freq) *
+                         (osc.C + step.C * frame) / sample_rate;
+    return std::pair(inc_c, inc_c * (osc.M + step.M * frame));
+  };
+
+  alignas(64) float angles[4][kChunkFrames];
+  for (size_t start = 0; start < buffer_size; start += kChunkFrames) {
+    size_t frames = std::min(kChunkFrames, buffer_size - start);
+    if (phase_mode_ == PhaseMode::kPhasor) {
+      // The rotators stay fixed over a chunk, so C and M step per chunk.
+      auto [inc_c, inc_m] = increments(start + frames * 0.5f);
+      AdvancePhasors(frames, inc_c, inc_m, angles[0], angles[1], angles[2],
+                     angles[3]);
+      args.source = ModFMKernelArgs::Source::kPhasors;
+      args.cos_c = angles[0];
+      args.sin_c = angles[1];
+      args.cos_m = angles[2];
+      args.sin_m = angles[3];
+    } else {
+      auto [inc_c, inc_m] = increments(start);
+      double dinc_c = 0.0, dinc_m = 0.0;
+      if (step.C != 0.0f || step.M != 0.0f) {
+        auto [end_c, end_m] = increments(start + frames);
+        dinc_c = (end_c - inc_c) / frames;
+        dinc_m = (end_m - inc_m) / frames;
+      }
+      AdvancePhases(frames, inc_c, dinc_c, inc_m, dinc_m, angles[0],
+                    angles[1]);
+      args.source = ModFMKernelArgs::Source::kPhases;
+      args.phase_c = angles[0];
+      args.phase_m = angles[1];
+    }
+    args.c = osc.C;
+    args.m = osc.M;
+    args.r = osc.R + step.R * start;
+    args.s = osc.S + step.S * start;
+    args.frames = frames;
+    args.level_a = level_a + start;
+    args.level_k = level_k + start;
+    args.out = buffer + start;
+    Dispatch(args, quality_);
+  }
+}
+
+void Oscillator::PerformWavetable(const Wavetable &wavetable,
+                                  size_t buffer_size, int sample_rate,
+                                  float buffer[],
+                                  float base_freq, const float level_a[],
+                                  const float level_k[]) {
+  const int mip_level = wavetable.MipLevelFor(base_freq, sample_rate);
+  const uint32_t inc = TableIncrement(base_freq, sample_rate);
+  on_table_ = true;
+  uint32_t phase = table_phase_;
+  for (size_t i = 0; i < buffer_size; i++) {
+    phase += inc;
+    buffer[i] += level_a[i] * wavetable.Sample(mip_level, phase, level_k[i]);
+  }
+  table_phase_ = phase;
+}
+
+void Oscillator::AdvancePhases(size_t frames, double inc_c, double dinc_c,
+                               double inc_m, double dinc_m, float phase_c[],
+                               float phase_m[]) {
+  // The accumulators are only wrapped once per chunk; a chunk can't advance
+  // far enough past 1.0 to cost the float phases any meaningful precision.
+  // The increment for frame i is inc + i * dinc, summed in closed form.
+  for (size_t i = 0; i < frames; i++) {
+    const double ramp = 0.5 * i * (i + 1);
+    phase_c[i] = static_cast<float>(phase_c_ + (i + 1) * inc_c + ramp * dinc_c);
+    phase_m[i] = static_cast<float>(phase_m_ + (i + 1) * inc_m + ramp * dinc_m);
+  }
+  const double ramp = 0.5 * frames * (frames - 1);
+  phase_c_ = Wrap(phase_c_ + frames * inc_c + ramp * dinc_c);
+  phase_m_ = Wrap(phase_m_ + frames * inc_m + ramp * dinc_m);
+}
+
+void Oscillator::AdvancePhasors(size_t frames, double inc_c, double inc_m,
+                                float cos_c[], float sin_c[], float cos_m[],
+                                float sin_m[]) {
+  constexpr double kTwoPiD = 2.0 * std::numbers::pi;
+
+  if (inc_c != rot_inc_c_) {
+    rot_inc_c_ = inc_c;
+    rot_c_ = std::polar(1.0, kTwoPiD * inc_c);
+  }
+  if (inc_m != rot_inc_m_) {
+    rot_inc_m_ = inc_m;
+    rot_m_ = std::polar(1.0, kTwoPiD * inc_m);
+  }
+
+  // Re-anchoring to the accumulators costs two sincos per chunk and keeps both
+  // the magnitude and the angle of the phasors from drifting.
+  std::complex<double> z_c = std::polar(1.0, kTwoPiD * phase_c_);
+  std::complex<double> z_m = std::polar(1.0, kTwoPiD * phase_m_);
+  for (size_t i = 0; i < frames; i++) {
+    z_c *= rot_c_;
+    z_m *= rot_m_;
+    cos_c[i] = static_cast<float>(z_c.real());
+    sin_c[i] = static_cast<float>(z_c.imag());
+    cos_m[i] = static_cast<float>(z_m.real());
+    sin_m[i] = static_cast<float>(z_m.imag());
+  }
+  phase_c_ = Wrap(phase_c_ + frames * inc_c);
+  phase_m_ = Wrap(phase_m_ + frames * inc_m);
+}
+
+void Oscillator::Reset() {
+  x_ = 0.0f;
+  phase_c_ = 0.0;
+  phase_m_ = 0.0;
+  table_phase_ = 0;
+  on_table_ = false;
+}
+
+Oscillator::ISA Oscillator::SupportedISA() { return kSupportedISA; }
+
+Oscillator::ISA Oscillator::ActiveISA() { return active_isa.load(); }
+
+void Oscillator::SetActiveISA(ISA isa) {
+  active_isa = isa > kSupportedISA ? kSupportedISA : isa;
+}
+
+const char *Oscillator::ISAName(ISA isa) {
+  switch (isa) {
+    case ISA::kSSE2:
+      return "SSE2";
+    case ISA::kAVX2:
+      return "AVX2";
+    case ISA::kAVX512:
+      return "AVX-512";
+    default:
+      return "scalar";
+  }
+}
+
+const char *Oscillator::QualityName(Quality quality) {
+  switch (quality) {
+    case Quality::kReference:
+      return "reference";
+    case Quality::kTable:
+      return "table";
+    default:
+      return "polynomial";
   }
 }
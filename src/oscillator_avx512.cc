@@ -0,0 +1,11 @@
+// AVX-512F build of the ModFM kernel. See oscillator_kernel_impl.h.
+#include "oscillator_kernel_impl.h"
+
+namespace {
+typedef float F __attribute__((vector_size(64)));
+typedef int32_t I __attribute__((vector_size(64)));
+}  // namespace
+
+void ModFMKernelAVX512(const ModFMKernelArgs &args) {
+  ModFMKernel<Vec<F, I>>(args);
+}
@@ -0,0 +1,221 @@
+#pragma once
+
+// Width generic, real valued ModFM kernel written against the GCC/Clang vector
+// extensions. Only include this from the per-ISA translation units; everything
+// lives in an anonymous namespace so that instantiations built with different
+// target flags can't be merged by the linker.
+
+#include <cstdint>
+#include <cstring>
+#include <numbers>
+
+#include "oscillator_kernels.h"
+
+namespace {
+
+// F and I are a float vector type and the int32_t vector type of the same
+// width, declared by the including translation unit. GCC drops vector_size
+// attributes that depend on a template parameter, so the width can't simply
+// be passed as an int.
+template <typename F_, typename I_>
+struct Vec {
+  typedef F_ F;
+  typedef I_ I;
+  static constexpr int N = sizeof(F) / sizeof(float);
+
+  static F Load(const float *p) {
+    F v;
+    std::memcpy(&v, p, sizeof(F));
+    return v;
+  }
+
+  static F Floor(F v) {
+    F t = __builtin_convertvector(__builtin_convertvector(v, I), F);
+    // Truncation rounds negative values up; comparisons yield -1 per lane.
+    return t + __builtin_convertvector(t > v, F);
+  }
+
+  static F Abs(F v) { return (F)((I)v & 0x7fffffff); }
+
+  // 0, 1, ..., N - 1.
+  static F Iota() {
+    F v;
+    for (int l = 0; l < N; l++) v[l] = static_cast<float>(l);
+    return v;
+  }
+
+  // sin(2 * pi * t) for t in turns. The argument is reduced to [-1/4, 1/4]
+  // turns and evaluated with an odd degree 11 polynomial; the absolute error is
+  // below 2.5e-7 (1.7e-7 measured), the bound Oscillator::Quality::kPolynomial
+  // quotes.
+  static F SinTurns(F t) {
+    t = t - Floor(t + 0.5f);
+    I sign = (I)t & (int32_t)0x80000000;
+    F u = 0.25f - Abs(Abs(t) - 0.25f);
+    F x = (F)((I)u | sign) * (2.0f * std::numbers::pi_v<float>);
+    F x2 = x * x;
+    F p = x2 * -2.5052108e-08f + 2.7557319e-06f;
+    p = p * x2 - 1.9841270e-04f;
+    p = p * x2 + 8.3333333e-03f;
+    p = p * x2 - 1.6666667e-01f;
+    return x + x * x2 * p;
+  }
+
+  static F CosTurns(F t) { return SinTurns(t + 0.25f); }
+};
+
+// Trig policies for ModFMFrames, both in turns.
+template <typename V>
+struct PolynomialTrig {
+  using F = typename V::F;
+  static F Sin(F t) { return V::SinTurns(t); }
+  static F Cos(F t) { return V::CosTurns(t); }
+};
+
+template <typename V>
+struct TableTrig {
+  using F = typename V::F;
+  using I = typename V::I;
+
+  static F Sin(F t) {
+    F pos = (t - V::Floor(t)) * static_cast<float>(kSineTableSize);
+    I index = __builtin_convertvector(pos, I);
+    F frac = pos - __builtin_convertvector(index, F);
+    // t - floor(t) can round up to exactly 1.0 for tiny negative t.
+    index &= kSineTableSize - 1;
+    F lo, hi;
+    for (int l = 0; l < V::N; l++) {
+      lo[l] = kSineTable[index[l]];
+      hi[l] = kSineTable[index[l] + 1];
+    }
+    return lo + frac * (hi - lo);
+  }
+  static F Cos(F t) { return Sin(t + 0.25f); }
+};
+
+// Evaluates the real part of
+//   A * exp(R * iK * cos(wm t)) * cos(wc t + iS * iK * sin(wm t))
+// which reduces to
+//   A * cos(RK cos(wm t)) * cos(wc t - SK sin(wm t))
+// N frames at a time; the imaginary part never reaches the output. Phases
+// are carried in turns rather than radians so the range reduction is a
+// single floor.
+//
+// `in` holds A and K followed by the source specific inputs, see InputsFor().
+// `frame` is the index of the first frame within the block.
+template <typename V, typename Trig, ModFMKernelArgs::Source kSource>
+void ModFMFrames(const ModFMKernelArgs &args, const float *const *in,
+                 size_t frame, float *re) {
+  using F = typename V::F;
+  constexpr float kInvTwoPi = 0.5f / std::numbers::pi_v<float>;
+
+  F K = V::Load(in[1]);
+  const F lane = V::Iota();
+  const F pos = static_cast<float>(frame) + lane;
+  F r = args.r + args.dr * pos;
+  F s = args.s + args.ds * pos;
+  F SK = s * kInvTwoPi * K;
+  F carrier, cos_m;
+  if constexpr (kSource == ModFMKernelArgs::Source::kPhasors) {
+    // cos(c - x) = cos(c)cos(x) + sin(c)sin(x), with the carrier and
+    // modulator angles already supplied as unit phasors.
+    F deviation = SK * V::Load(in[5]);
+    cos_m = V::Load(in[4]);
+    carrier = V::Load(in[2]) * Trig::Cos(deviation) +
+              V::Load(in[3]) * Trig::Sin(deviation);
+  } else {
+    F phase_c, phase_m;
+    if constexpr (kSource == ModFMKernelArgs::Source::kClock) {
+      F t = (args.x + static_cast<float>(frame) + (lane + 1.0f)) /
+            args.sample_rate;
+      const float freq_c = args.base_freq * args.c;
+      phase_c = freq_c * t;
+      phase_m = args.m * freq_c * t;
+    } else {
+      phase_c = V::Load(in[2]);
+      phase_m = V::Load(in[3]);
+    }
+    cos_m = Trig::Cos(phase_m);
+    carrier = Trig::Cos(phase_c - SK * Trig::Sin(phase_m));
+  }
+  F index = r * kInvTwoPi * K * cos_m;
+  F amp = V::Load(in[0]) * carrier;
+  F out_re = amp * Trig::Cos(index);
+  std::memcpy(re, &out_re, sizeof(F));
+}
+
+inline int InputsFor(const ModFMKernelArgs &args, const float *in[6]) {
+  in[0] = args.level_a;
+  in[1] = args.level_k;
+  switch (args.source) {
+    case ModFMKernelArgs::Source::kClock:
+      return 2;
+    case ModFMKernelArgs::Source::kPhases:
+      in[2] = args.phase_c;
+      in[3] = args.phase_m;
+      return 4;
+    case ModFMKernelArgs::Source::kPhasors:
+      in[2] = args.cos_c;
+      in[3] = args.sin_c;
+      in[4] = args.cos_m;
+      in[5] = args.sin_m;
+      return 6;
+  }
+  return 2;
+}
+
+template <typename V, typename Trig, ModFMKernelArgs::Source kSource>
+void ModFMKernelFor(const ModFMKernelArgs &args) {
+  constexpr int N = V::N;
+
+  const float *base[6];
+  const int num_inputs = InputsFor(args, base);
+  const float *in[6];
+  float *out = args.out;
+  float re[N];
+  size_t i = 0;
+  for (; i + N <= args.frames; i += N) {
+    for (int j = 0; j < num_inputs; j++) in[j] = base[j] + i;
+    ModFMFrames<V, Trig, kSource>(args, in, i, re);
+    for (int l = 0; l < N; l++) out[i + l] += re[l];
+  }
+
+  // Pad the tail out to a full vector rather than falling back to scalar math,
+  // so every frame sees the same approximation.
+  size_t remaining = args.frames - i;
+  if (remaining) {
+    float padded[6][N]{};
+    for (int j = 0; j < num_inputs; j++) {
+      std::memcpy(padded[j], base[j] + i, remaining * sizeof(float));
+      in[j] = padded[j];
+    }
+    ModFMFrames<V, Trig, kSource>(args, in, i, re);
+    for (size_t l = 0; l < remaining; l++) out[i + l] += re[l];
+  }
+}
+
+template <typename V, typename Trig>
+void ModFMKernelWith(const ModFMKernelArgs &args) {
+  switch (args.source) {
+    case ModFMKernelArgs::Source::kClock:
+      ModFMKernelFor<V, Trig, ModFMKernelArgs::Source::kClock>(args);
+      break;
+    case ModFMKernelArgs::Source::kPhases:
+      ModFMKernelFor<V, Trig, ModFMKernelArgs::Source::kPhases>(args);
+      break;
+    case ModFMKernelArgs::Source::kPhasors:
+      ModFMKernelFor<V, Trig, ModFMKernelArgs::Source::kPhasors>(args);
+      break;
+  }
+}
+
+template <typename V>
+void ModFMKernel(const ModFMKernelArgs &args) {
+  if (args.table) {
+    ModFMKernelWith<V, TableTrig<V>>(args);
+  } else {
+    ModFMKernelWith<V, PolynomialTrig<V>>(args);
+  }
+}
+
+}  // namespace
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+
+// Arguments for one block of the ModFM formula, shared between the scalar
+// loops in oscillator.cc and the ISA specific vector kernels. Kernels
+// accumulate into `out` so generators can render straight into a mix.
+struct ModFMKernelArgs {
+  // Where the carrier and modulator angles come from.
+  enum class Source {
+    // Derived from a running sample counter, as the original oscillator did.
+    kClock,
+    // Per frame phases in turns, as produced by a phase accumulator.
+    kPhases,
+    // Per frame unit phasors (cos, sin) of the carrier and modulator.
+    kPhasors,
+  };
+
+  size_t frames;
+  Source source;
+  // Use kSineTable instead of the polynomial approximation.
+  bool table;
+
+  // Oscillator parameters. C and M are constant over the block; R and S
+  // move by dr and ds per frame, e.g. r + dr * i at frame i.
+  float c;
+  float m;
+  float r;
+  float s;
+  float dr;
+  float ds;
+
+  // kClock: time is (x + frame + 1) / sample_rate.
+  float sample_rate;
+  float base_freq;
+  float x;
+
+  // kPhases.
+  const float *phase_c;
+  const float *phase_m;
+
+  // kPhasors.
+  const float *cos_c;
+  const float *sin_c;
+  const float *cos_m;
+  const float *sin_m;
+
+  // Amplitude and modulation index per frame, envelopes applied.
+  const float *level_a;
+  const float *level_k;
+  // Output is added to, not overwritten.
+  float *out;
+};
+
+// One cycle of sin(2 * pi * t) plus a guard point, for the table lookup
+// quality tier. Built in oscillator.cc.
+constexpr int kSineTableBits = 10;
+constexpr int kSineTableSize = 1 << kSineTableBits;
+extern const std::array<float, kSineTableSize + 1> kSineTable;
+
+// Each of these is compiled in its own translation unit with the matching
+// target flags, and must only be called when the CPU supports that ISA.
+void ModFMKernelSSE2(const ModFMKernelArgs &args);
+void ModFMKernelAVX2(const ModFMKernelArgs &args);
+void ModFMKernelAVX512(const ModFMKernelArgs &args);
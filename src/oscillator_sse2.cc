@@ -0,0 +1,12 @@
+// SSE2 (baseline on x86-64) build of the ModFM kernel. See
+// oscillator_kernel_impl.h.
+#include "oscillator_kernel_impl.h"
+
+namespace {
+typedef float F __attribute__((vector_size(16)));
+typedef int32_t I __attribute__((vector_size(16)));
+}  // namespace
+
+void ModFMKernelSSE2(const ModFMKernelArgs &args) {
+  ModFMKernel<Vec<F, I>>(args);
+}
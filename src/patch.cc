@@ -1,10 +1,19 @@
 #include "patch.h"
 
+#include <algorithm>
+
+#include "envgen.h"
+#include "wavetable.h"
+
+Patch::Patch() : snapshots_(std::make_unique<PatchSnapshot>()) {}
+
 GeneratorPatch *Patch::AddGenerator() {
   std::lock_guard<std::mutex> patches_lock(patches_mutex_);
   generators_.push_back(std::make_unique<GeneratorPatch>(1.0, 0.5));
   GeneratorPatch *n_gp = generators_.back().get();
+  n_gp->owner_ = this;
   AddGeneratorSignal(n_gp);
+  PublishLocked();
   return n_gp;
 }
 
@@ -14,11 +23,29 @@ void Patch::RmGenerator(GeneratorPatch *patch) {
     if (it->get() == patch) {
       RmGeneratorSignal(patch, it - generators_.begin());
       generators_.erase(it);
+      PublishLocked();
       break;
     }
   }
 }
 
+void Patch::Publish() {
+  std::lock_guard<std::mutex> patches_lock(patches_mutex_);
+  PublishLocked();
+}
+
+void Patch::PublishLocked() {
+  auto snapshot = std::make_unique<PatchSnapshot>();
+  snapshot->version = ++version_;
+  snapshot->generators.reserve(generators_.size());
+  for (const auto &g : generators_) {
+    std::lock_guard<std::mutex> lg(g->gp_mutex_);
+    snapshot->generators.push_back({g.get(), g->osc_, g->a_env_, g->k_env_,
+                                    g->modulation_, g->wavetable_});
+  }
+  snapshots_.Publish(std::move(snapshot));
+}
+
 std::vector<const GeneratorPatch *> Patch::generators() const {
   std::lock_guard<std::mutex> patches_lock(patches_mutex_);
   std::vector<const GeneratorPatch *> gs;
@@ -31,37 +58,86 @@ std::vector<const GeneratorPatch *> Patch::generators() const {
 GeneratorPatch::GeneratorPatch(float ratio, float amplitude)
     : osc_{ratio, amplitude, 1, 0, 1, 0},
       a_env_(kDefaultAmpEnvelope),
-      k_env_(kDefaultCarEnvelope){};
+      k_env_(kDefaultCarEnvelope),
+      wavetable_(WavetableFor(osc_, k_env_)){};
 
 bool GeneratorPatch::operator==(const GeneratorPatch &rhs) const {
-  return osc_ == rhs.osc_ && a_env_ == rhs.a_env_ && k_env_ == rhs.k_env_;
+  return osc_ == rhs.osc_ && a_env_ == rhs.a_env_ && k_env_ == rhs.k_env_ &&
+         modulation_ == rhs.modulation_;
 }
 
 GeneratorPatch::GeneratorPatch(const GeneratorPatch::Osc &osc,
                                const GeneratorPatch::Envelope &a_env,
                                const GeneratorPatch::Envelope &k_env)
-    : osc_(osc), a_env_(a_env), k_env_(k_env) {}
-
-void GeneratorPatch::WithLock(
-    std::function<void(const Osc &, const Envelope &, const Envelope &)> f)
-    const {
-  std::lock_guard<std::mutex> lg(gp_mutex_);
-  f(osc_, a_env_, k_env_);
-}
+    : osc_(osc),
+      a_env_(a_env),
+      k_env_(k_env),
+      wavetable_(WavetableFor(osc_, k_env_)) {}
 
 void GeneratorPatch::Update(std::optional<Osc> osc,
                             std::optional<Envelope> a_env,
                             std::optional<Envelope> k_env) {
-  std::lock_guard<std::mutex> lg(gp_mutex_);
-  if (osc) {
-    osc_ = osc.value();
+  Osc new_osc;
+  Envelope new_k_env;
+  uint64_t generation;
+  {
+    std::lock_guard<std::mutex> lg(gp_mutex_);
+    if (osc) {
+      osc_ = osc.value();
+    }
+    if (a_env) {
+      a_env_ = a_env.value();
+    }
+    if (k_env) {
+      k_env_ = k_env.value();
+    }
+    if (osc || k_env) {
+      // The old table no longer matches; the formula stands in until the
+      // new one is ready.
+      wavetable_ = nullptr;
+      generation = ++wavetable_generation_;
+    }
+    new_osc = osc_;
+    new_k_env = k_env_;
   }
-  if (a_env) {
-    a_env_ = a_env.value();
+
+  if (osc || k_env) {
+    // Building a table can take a while, so do it outside the lock. An
+    // Update() that came in meanwhile has a newer table on the way, which
+    // this one mustn't overwrite.
+    auto wavetable = WavetableFor(new_osc, new_k_env);
+    std::lock_guard<std::mutex> lg(gp_mutex_);
+    if (generation == wavetable_generation_) wavetable_ = std::move(wavetable);
   }
-  if (k_env) {
-    k_env_ = k_env.value();
+  if (owner_) owner_->Publish();
+}
+
+void GeneratorPatch::SetModulation(const Modulation &modulation) {
+  {
+    std::lock_guard<std::mutex> lg(gp_mutex_);
+    modulation_ = modulation;
   }
+  if (owner_) owner_->Publish();
+}
+
+GeneratorPatch::Modulation GeneratorPatch::modulation() const {
+  std::lock_guard<std::mutex> lg(gp_mutex_);
+  return modulation_;
+}
+
+std::shared_ptr<const Wavetable> GeneratorPatch::wavetable() const {
+  std::lock_guard<std::mutex> lg(gp_mutex_);
+  return wavetable_;
+}
+
+std::shared_ptr<const Wavetable> GeneratorPatch::WavetableFor(
+    const Osc &osc, const Envelope &k_env) {
+  // The K envelope never rises above the highest level of any segment.
+  const auto program = EnvelopeProgram::FromEnvelope(k_env);
+  float peak = 0.0f;
+  for (int i = 0; i < program.num_segments; i++)
+    peak = std::max(peak, program.segments[i].level);
+  return Wavetable::Get(osc, osc.K * peak);
 }
 
 bool GeneratorPatch::Osc::operator==(const GeneratorPatch::Osc &rhs) const {
@@ -71,6 +147,32 @@ bool GeneratorPatch::Osc::operator==(const GeneratorPatch::Osc &rhs) const {
 
 bool GeneratorPatch::Envelope::operator==(
     const GeneratorPatch::Envelope &rhs) const {
-  return A_R == rhs.A_R && A_L == rhs.A_L && D_R == rhs.D_R && S_L == rhs.S_L &&
-         R_R == rhs.R_R;
+  if (A_R != rhs.A_R || A_L != rhs.A_L || D_R != rhs.D_R || S_L != rhs.S_L ||
+      R_R != rhs.R_R || num_segments != rhs.num_segments ||
+      sustain != rhs.sustain || loop_start != rhs.loop_start ||
+      loop_end != rhs.loop_end)
+    return false;
+  for (int i = 0; i < kMaxSegments; i++) {
+    if (segments[i].level != rhs.segments[i].level ||
+        segments[i].time != rhs.segments[i].time)
+      return false;
+  }
+  return true;
+}
+
+bool GeneratorPatch::Modulation::operator==(
+    const GeneratorPatch::Modulation &rhs) const {
+  for (int i = 0; i < kNumLFOs; i++) {
+    if (lfos[i].shape != rhs.lfos[i].shape || lfos[i].rate != rhs.lfos[i].rate)
+      return false;
+  }
+  if (num_routes != rhs.num_routes) return false;
+  for (int i = 0; i < num_routes; i++) {
+    const auto &a = routes[i];
+    const auto &b = rhs.routes[i];
+    if (a.source != b.source || a.target != b.target || a.cc != b.cc ||
+        a.depth != b.depth)
+      return false;
+  }
+  return true;
 }
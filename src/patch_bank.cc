@@ -0,0 +1,179 @@
+#include "patch_bank.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+namespace {
+
+absl::Status Invalid(const std::string &path, const std::string &what) {
+  return absl::Status(absl::StatusCode::kInvalidArgument,
+                      path + ": " + what);
+}
+
+}  // namespace
+
+absl::StatusOr<std::unique_ptr<PatchBank>> PatchBank::Open(
+    const std::string &path) {
+  const int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return absl::Status(absl::StatusCode::kNotFound,
+                        "Unable to open " + path + ": " + strerror(errno));
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return absl::Status(absl::StatusCode::kInternal,
+                        "Unable to stat " + path + ": " + strerror(errno));
+  }
+  const size_t size = st.st_size;
+  if (size < sizeof(Header)) {
+    close(fd);
+    return Invalid(path, "too short for a patch bank");
+  }
+  void *data = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    return absl::Status(absl::StatusCode::kInternal,
+                        "Unable to map " + path + ": " + strerror(errno));
+  }
+  std::unique_ptr<PatchBank> bank(new PatchBank(data, size));
+
+  const Header &header = *bank->header_;
+  if (std::memcmp(header.magic, kMagic, sizeof(kMagic)) != 0)
+    return Invalid(path, "not a patch bank");
+  if (header.version != kVersion) {
+    return Invalid(path, "patch bank version " +
+                             std::to_string(header.version) + ", expected " +
+                             std::to_string(kVersion));
+  }
+  const uint64_t expected = sizeof(Header) +
+                            uint64_t{header.num_programs} * sizeof(Program) +
+                            uint64_t{header.num_generators} * sizeof(Generator);
+  if (size != expected) {
+    return Invalid(path, "size " + std::to_string(size) + " doesn't match " +
+                             std::to_string(header.num_programs) +
+                             " programs and " +
+                             std::to_string(header.num_generators) +
+                             " generators");
+  }
+  bank->generators_ = reinterpret_cast<const Generator *>(
+      bank->programs_ + header.num_programs);
+  return bank;
+}
+
+absl::Status PatchBank::Write(const std::string &path,
+                              const std::vector<Entry> &programs) {
+  Header header{};
+  std::memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kVersion;
+  header.num_programs = programs.size();
+  std::vector<Program> records(programs.size());
+  for (size_t i = 0; i < programs.size(); i++) {
+    const auto &program = programs[i];
+    if (program.name.size() > kNameSize)
+      return Invalid(path, "program name too long: " + program.name);
+    std::memset(&records[i], 0, sizeof(Program));
+    std::memcpy(records[i].name, program.name.data(), program.name.size());
+    records[i].first_generator = header.num_generators;
+    records[i].num_generators = program.generators.size();
+    header.num_generators += program.generators.size();
+    header.max_generators =
+        std::max<uint32_t>(header.max_generators, program.generators.size());
+  }
+
+  std::FILE *file = std::fopen(path.c_str(), "wb");
+  if (!file) {
+    return absl::Status(absl::StatusCode::kNotFound,
+                        "Unable to create " + path + ": " + strerror(errno));
+  }
+  bool ok = std::fwrite(&header, sizeof(header), 1, file) == 1;
+  if (!records.empty())
+    ok &= std::fwrite(records.data(), sizeof(Program), records.size(), file) ==
+          records.size();
+  for (const auto &program : programs) {
+    for (const auto &g : program.generators) {
+      // Through a zeroed copy so padding doesn't leak into the file.
+      Generator record;
+      std::memset(static_cast<void *>(&record), 0, sizeof(record));
+      record.osc = g.osc;
+      record.a_env = g.a_env;
+      record.k_env = g.k_env;
+      record.modulation.lfos = g.modulation.lfos;
+      record.modulation.num_routes =
+          std::clamp(g.modulation.num_routes, 0,
+                     GeneratorPatch::Modulation::kMaxRoutes);
+      for (int r = 0; r < record.modulation.num_routes; r++)
+        record.modulation.routes[r] = g.modulation.routes[r];
+      ok &= std::fwrite(&record, sizeof(record), 1, file) == 1;
+    }
+  }
+  ok &= std::fclose(file) == 0;
+  if (!ok) {
+    return absl::Status(absl::StatusCode::kInternal,
+                        "Unable to write " + path);
+  }
+  return absl::OkStatus();
+}
+
+PatchBank::Entry PatchBank::FromPatch(const Patch &patch, std::string name) {
+  Entry entry{std::move(name), {}};
+  for (const auto *g : patch.generators()) {
+    Generator record{};
+    g->WithLock([&](const GeneratorPatch::Osc &osc,
+                    const GeneratorPatch::Envelope &a_env,
+                    const GeneratorPatch::Envelope &k_env) {
+      record.osc = osc;
+      record.a_env = a_env;
+      record.k_env = k_env;
+    });
+    record.modulation = g->modulation();
+    entry.generators.push_back(record);
+  }
+  return entry;
+}
+
+PatchBank::PatchBank(const void *data, size_t size)
+    : data_(data),
+      size_(size),
+      header_(static_cast<const Header *>(data)),
+      programs_(reinterpret_cast<const Program *>(header_ + 1)),
+      generators_(nullptr) {}
+
+PatchBank::~PatchBank() { munmap(const_cast<void *>(data_), size_); }
+
+std::string_view PatchBank::name(int program) const {
+  if (program < 0 || program >= num_programs()) return {};
+  const char *name = programs_[program].name;
+  return std::string_view(name, strnlen(name, kNameSize));
+}
+
+std::span<const PatchBank::Generator> PatchBank::generators(
+    int program) const {
+  if (program < 0 || program >= num_programs()) return {};
+  const Program &p = programs_[program];
+  if (p.num_generators > header_->max_generators ||
+      p.first_generator > header_->num_generators ||
+      p.num_generators > header_->num_generators - p.first_generator)
+    return {};
+  return {generators_ + p.first_generator, p.num_generators};
+}
+
+void PatchBank::Load(const Generator &generator,
+                     PatchSnapshot::Generator *out) {
+  out->source = nullptr;
+  out->osc = generator.osc;
+  out->a_env = generator.a_env;
+  out->k_env = generator.k_env;
+  out->modulation = generator.modulation;
+  out->modulation.num_routes =
+      std::clamp(out->modulation.num_routes, 0,
+                 GeneratorPatch::Modulation::kMaxRoutes);
+  out->wavetable = nullptr;
+}
@@ -2,245 +2,986 @@
 
 #include <glog/logging.h>
 
+#include <algorithm>
+#include <atomic>
 #include <cmath>
-#include <execution>
+#include <cstring>
+#include <limits>
 #include <memory>
 #include <mutex>
+#include <numbers>
 
+#include "allocation_guard.h"
 #include "oscillator.h"
+#include "trace.h"
+#include "wavetable.h"
 
 namespace {
 
 constexpr float kNoteConversionMultiplier = 440.0f / 32.0f;
 
+std::atomic<uint32_t> trace_ids{0};
+
 float NoteToFreq(float note) {
   return kNoteConversionMultiplier * std::pow(2.0f, ((note - 9.0f) / 12.0f));
 }
 
+// `phase` in turns, 0 to 1. Every shape starts at its midpoint and rises.
+float LFOValue(GeneratorPatch::Modulation::LFO::Shape shape, double phase) {
+  using Shape = GeneratorPatch::Modulation::LFO::Shape;
+  const float p = static_cast<float>(phase);
+  switch (shape) {
+    case Shape::kTriangle:
+      return 1.0f - 4.0f * std::fabs(p - std::floor(p + 0.25f) - 0.25f);
+    case Shape::kSaw:
+      return p < 0.5f ? 2.0f * p : 2.0f * p - 2.0f;
+    case Shape::kSquare:
+      return p < 0.5f ? 1.0f : -1.0f;
+    default:
+      return std::sin(2.0f * std::numbers::pi_v<float> * p);
+  }
+}
+
+float &OscParam(GeneratorPatch::Osc &osc,
+                GeneratorPatch::Modulation::Target target) {
+  using Target = GeneratorPatch::Modulation::Target;
+  switch (target) {
+    case Target::kA:
+      return osc.A;
+    case Target::kM:
+      return osc.M;
+    case Target::kK:
+      return osc.K;
+    case Target::kR:
+      return osc.R;
+    case Target::kS:
+      return osc.S;
+    default:
+      return osc.C;
+  }
+}
+
+// Highest parameter values the patch's routes can reach, as magnitudes.
+GeneratorPatch::Osc PeakOsc(const PatchSnapshot::Generator &patch) {
+  const auto &osc = patch.osc;
+  GeneratorPatch::Osc peak{std::fabs(osc.C), std::fabs(osc.A),
+                           std::fabs(osc.M), std::fabs(osc.K),
+                           std::fabs(osc.R), std::fabs(osc.S)};
+  const auto &modulation = patch.modulation;
+  for (int i = 0; i < modulation.num_routes; i++) {
+    OscParam(peak, modulation.routes[i].target) +=
+        std::fabs(modulation.routes[i].depth);
+  }
+  return peak;
+}
+
+// Sidebands either side of the carrier with significant energy at
+// modulation index `k`, by Carson's rule: past the index plus one they are
+// negligible. The R (exp of K cos) and S (phase modulation by K sin) terms
+// add their indices.
+float Sidebands(const GeneratorPatch::Osc &peak, float k) {
+  return k > 0.0f ? (peak.R + peak.S) * k + 1.0f : 0.0f;
+}
+
+// Highest frequency with significant energy at modulation index `k`.
+float Bandwidth(const GeneratorPatch::Osc &peak, float k, float base_freq) {
+  const float carrier = peak.C * base_freq;
+  return carrier + carrier * peak.M * Sidebands(peak, k);
+}
+
 } // namespace
 
-Player::Player(Patch *patch, int num_voices, int sample_frequency)
+Player::Player(Patch *patch, int num_voices, int sample_frequency,
+               size_t max_frames_per_buffer, int render_threads)
     : patch_(patch), num_voices_(num_voices),
-      sample_frequency_(sample_frequency) {
-  std::vector<const GeneratorPatch *> generators = patch_->generators();
+      sample_frequency_(sample_frequency),
+      max_frames_per_buffer_(max_frames_per_buffer),
+      trace_id_(++trace_ids),
+      render_pool_(render_threads, max_frames_per_buffer) {
+  LOG(INFO) << "Oscillator kernel: "
+            << Oscillator::ISAName(Oscillator::ActiveISA());
+
+  voices_.resize(num_voices);
+  // Popped from the back, so hand out voice 0 first.
+  for (int i = num_voices - 1; i >= 0; i--) free_voices_.push_back(i);
+  note_voices_.fill(-1);
+
+  layout_ = std::make_unique<VoiceLayout>();
+  // Not under layout_mutex_: the patch holds its own lock while calling the
+  // signals below, which take layout_mutex_.
+  auto generators = patch_->generators();
+  {
+    std::lock_guard<std::mutex> layout_lock(layout_mutex_);
+    PublishLayout(std::move(generators));
+  }
+  ApplyLayouts();
+
+  // Removal goes by pointer rather than the index passed, which may have
+  // shifted by the time a layout built from it is swapped in.
+  patch_->RmGeneratorSignal.connect([this](GeneratorPatch *g_patch, int) {
+    std::lock_guard<std::mutex> layout_lock(layout_mutex_);
+    auto generators = generator_patches_;
+    std::erase(generators, g_patch);
+    PublishLayout(std::move(generators));
+  });
+
+  patch_->AddGeneratorSignal.connect([this](GeneratorPatch *g_patch) {
+    std::lock_guard<std::mutex> layout_lock(layout_mutex_);
+    auto generators = generator_patches_;
+    generators.push_back(g_patch);
+    PublishLayout(std::move(generators));
+  });
+}
+
+Player::~Player() {
+  VoiceLayout *layout;
+  while (pending_layouts_.Pop(&layout)) delete layout;
+  while (retired_layouts_.Pop(&layout)) delete layout;
+}
 
-  for (int i = 0; i < num_voices; i++) {
-    Voice v;
-    for (auto &g : generators) {
-      v.generators_.emplace_back(std::make_unique<Generator>(sample_frequency));
+void Player::PublishLayout(std::vector<const GeneratorPatch *> generators) {
+  VoiceLayout *retired;
+  while (retired_layouts_.Pop(&retired)) delete retired;
+
+  auto layout = std::make_unique<VoiceLayout>();
+  for (const auto *g : generators) {
+    auto it =
+        std::find(generator_patches_.begin(), generator_patches_.end(), g);
+    if (it != generator_patches_.end()) {
+      layout->carried.push_back(it - generator_patches_.begin());
+      layout->banks.emplace_back();
+      layout->pending.emplace_back();
+    } else {
+      layout->carried.push_back(-1);
+      layout->banks.emplace_back(num_voices_, Generator(sample_frequency_));
+      layout->pending.emplace_back(num_voices_, false);
     }
-    voices_.push_back(std::move(v));
   }
+  layout->tasks.reserve(num_voices_ * generators.size());
+  layout->generators = generators;
+  generator_patches_ = std::move(generators);
 
-  patch_->RmGeneratorSignal.connect(
-      [this](GeneratorPatch *g_patch, int gennum) {
-        std::lock_guard<std::mutex> l(voices_mutex_);
-        for (auto &voice : voices_) {
-          voice.generators_.erase(voice.generators_.begin() + gennum);
-        }
-      });
+  if (!pending_layouts_.Push(layout.get())) {
+    // The audio thread hasn't been taking them; nothing is playing, or it
+    // will wait a buffer.
+    std::lock_guard<std::mutex> player_lock(voices_mutex_);
+    ApplyLayouts();
+    CHECK(pending_layouts_.Push(layout.get()));
+  }
+  layout.release();
+}
 
-  patch_->AddGeneratorSignal.connect([this](GeneratorPatch *g_patch) {
-    std::lock_guard<std::mutex> l(voices_mutex_);
-    for (auto &voice : voices_) {
-      voice.generators_.push_back(
-          std::make_unique<Generator>(sample_frequency_));
+void Player::ApplyLayouts() {
+  VoiceLayout *next;
+  while (pending_layouts_.Pop(&next)) {
+    for (size_t g = 0; g < next->banks.size(); g++) {
+      if (next->carried[g] >= 0) {
+        next->banks[g] = std::move(layout_->banks[next->carried[g]]);
+        next->pending[g] = std::move(layout_->pending[next->carried[g]]);
+      } else {
+        for (int v = 0; v < num_voices_; v++) Configure(next->banks[g][v]);
+      }
     }
-  });
+    if (next->tasks.capacity() > tasks_.capacity())
+      std::swap(tasks_, next->tasks);
+    // Banks of removed generators leave with the old layout. Voices left
+    // with nothing playing are freed at the end of the next block.
+    CHECK(retired_layouts_.Push(layout_.release()));
+    layout_.reset(next);
+  }
+}
+
+void Player::Configure(Generator &g) const {
+  g.SetQuality(quality_);
+  g.SetControlPeriod(control_period_);
+  g.SetMaxOversampling(max_oversampling_);
+  g.SetIndexClamping(clamp_index_);
 }
 
 bool Player::Perform(const void *in_buffer, void *out_buffer,
-                     size_t frames_per_buffer) {
-  memset(out_buffer, 0, frames_per_buffer * sizeof(float));
+                     size_t frames_per_buffer,
+                     std::optional<double> block_time_ms) {
+  ScopedAllocationGuard no_allocations;
+  auto *f_buffer = (float *)out_buffer;
+  const auto start = RenderPool::Clock::now();
+  const std::chrono::duration<double> period(
+      static_cast<double>(frames_per_buffer) / sample_frequency_);
+
+  // Leave some of the buffer period for the host and the mixdown.
+  deadline_ = RenderPool::Clock::time_point::max();
+  if (deadline_fraction_ > 0) {
+    deadline_ = start + std::chrono::duration_cast<RenderPool::Clock::duration>(
+                            deadline_fraction_ * period);
+  }
 
-  std::mutex buffer_mutex;
-  std::vector<std::unique_ptr<std::complex<float>[]>> mix_buffers;
+  std::lock_guard<std::mutex> player_lock(voices_mutex_);
+  ApplyLayouts();
+  auto snapshot = patch_->snapshot();
+  ScheduleEvents(frames_per_buffer, block_time_ms);
+  RenderStats::Overrun buffer_stats;
+  buffer_stats.frame = frame_;
+  buffer_stats.patch_edit = snapshot->version != stats_patch_version_;
+  stats_patch_version_ = snapshot->version;
+  rendered_tasks_ = 0;
+
+  // Render up to each event, then apply it, so notes start and stop on the
+  // frame they were scheduled for whatever the buffer size.
+  const uint64_t end = frame_ + frames_per_buffer;
+  size_t next = 0;
+  while (frame_ < end) {
+    MODFM_TRACE_FRAME(trace_id_, frame_);
+    while (next < num_pending_ && pending_[next].frame <= frame_) {
+      ApplyEvent(Current(*snapshot), pending_[next++].event);
+    }
+    uint64_t stop = std::min<uint64_t>(end, frame_ + max_frames_per_buffer_);
+    if (next < num_pending_)
+      stop = std::min(stop, pending_[next].frame);
+    size_t frames = stop - frame_;
+    RenderBlock(Current(*snapshot), f_buffer, frames);
+    f_buffer += frames;
+  }
+  std::move(pending_.begin() + next, pending_.begin() + num_pending_,
+            pending_.begin());
+  num_pending_ -= next;
+
+  buffer_stats.voices = num_active_voices_;
+  buffer_stats.generators = rendered_tasks_;
+  buffer_stats.load = (RenderPool::Clock::now() - start) / period;
+  stats_.RecordBuffer(buffer_stats);
+  if (buffer_stats.load > 1.0f)
+    MODFM_TRACE(TraceEvent::kOverrun, buffer_stats.patch_edit,
+                num_active_voices_, buffer_stats.load);
+  return true;
+}
 
-  {
-    std::lock_guard<std::mutex> player_lock(voices_mutex_);
-    auto g_patches = patch_->generators();
-
-    std::for_each(
-        std::execution::par_unseq, voices_.begin(), voices_.end(),
-        [frames_per_buffer, this, &mix_buffers, &buffer_mutex,
-         &g_patches](Voice &voice) {
-          // Probably faster without the branch in a loop...
-          for (int g_num = 0; g_num < voice.generators_.size(); g_num++) {
-            auto &g = voice.generators_[g_num];
-            if (!g->Playing())
-              continue;
-            auto mix_buffer =
-                std::make_unique<std::complex<float>[]>(frames_per_buffer);
-            g->Perform(*g_patches[g_num], mix_buffer.get(), voice.base_freq,
-                       frames_per_buffer);
-            {
-              std::lock_guard<std::mutex> buffer_lock(buffer_mutex);
-              mix_buffers.push_back(std::move(mix_buffer));
-            }
-          }
-        });
-  }
-
-  // Mix down.
-  if (!mix_buffers.empty()) {
-    std::vector<std::complex<float>> mix_buffer(frames_per_buffer, 0.0f);
-    for (auto &v_buffer : mix_buffers) {
-      if (v_buffer)
-        for (int i = 0; i < frames_per_buffer; i++) {
-          mix_buffer[i] += v_buffer.get()[i];
+const PatchSnapshot::Generator *Player::PatchFor(const PatchSnapshot &snapshot,
+                                                int g_num) const {
+  if (program_ >= 0) {
+    return g_num < snapshot.generators.size() ? &snapshot.generators[g_num]
+                                              : nullptr;
+  }
+  // Layouts and snapshots for a generator being added or removed reach the
+  // audio thread separately, so for a buffer or so the two can disagree.
+  // Sit those generators out rather than play the wrong settings.
+  if (g_num >= snapshot.generators.size()) return nullptr;
+  const auto &gp = snapshot.generators[g_num];
+  return gp.source == layout_->generators[g_num] ? &gp : nullptr;
+}
+
+const PatchSnapshot::Generator *Player::FindPatch(
+    const PatchSnapshot &snapshot, int g_num) const {
+  if (program_ >= 0) return nullptr;
+  for (const auto &gp : snapshot.generators) {
+    if (gp.source == layout_->generators[g_num]) return &gp;
+  }
+  return nullptr;
+}
+
+void Player::RenderBlock(const PatchSnapshot &snapshot, float *out,
+                         size_t frames) {
+  // Ranges were worked out against the patch as it was at note on.
+  const bool patch_changed = snapshot.version != range_version_;
+  range_version_ = snapshot.version;
+
+  // Every playing generator of every active voice is a task of its own.
+  // Tasks are listed a bank at a time, so each worker's share covers few
+  // generators and their patch data stays in cache.
+  tasks_.clear();
+  auto &banks = CurrentBanks();
+  for (int g_num = 0; g_num < banks.size(); g_num++) {
+    auto &bank = banks[g_num];
+    const auto *gp = PatchFor(snapshot, g_num);
+    if (!gp) {
+      // Silent for now, but kept in time with the rest of the voice.
+      if (const auto *moved = FindPatch(snapshot, g_num)) {
+        for (int v = active_head_; v != -1; v = voices_[v].next) {
+          if (bank[v].Playing()) bank[v].Skip(*moved, frames);
         }
+      }
+      continue;
     }
-
-    auto *f_buffer = (float *)out_buffer;
-    for (int i = 0; i < frames_per_buffer; i++) {
-      f_buffer[i] = mix_buffer[i].real();
+    for (int v = active_head_; v != -1; v = voices_[v].next) {
+      Generator &g = bank[v];
+      if (program_ < 0 && layout_->pending[g_num][v]) {
+        layout_->pending[g_num][v] = false;
+        g.NoteOn(*gp, 0, voices_[v].velocity, voices_[v].note);
+        g.UpdateRange(*gp, voices_[v].base_freq);
+      }
+      if (patch_changed && g.Playing())
+        g.UpdateRange(*gp, voices_[v].base_freq);
+      if (!g.Playing() || g.Cull(*gp, audibility_threshold_))
+        continue;
+      if (g.ultrasonic())
+        g.Skip(*gp, frames);
+      else
+        tasks_.push_back({&g, gp, voices_[v].base_freq});
     }
   }
-  return true;
+
+  size_t skipped = render_pool_.Run(
+      tasks_.size(), frames, deadline_, out,
+      [this, frames](size_t i, float *buffer) {
+        MODFM_TRACE_FRAME(trace_id_, frame_);
+        const auto &task = tasks_[i];
+        task.generator->Perform(*task.patch, buffer, task.base_freq,
+                                controllers_, frames);
+      });
+  if (skipped) {
+    MODFM_TRACE(TraceEvent::kRenderDeadline, 0, skipped);
+    stats_.RecordSkipped(skipped);
+  }
+  rendered_tasks_ += tasks_.size() - skipped;
+
+  frame_ += frames;
+  ReleaseFinishedVoices();
 }
 
 void Player::NoteOn(unsigned long ts, uint8_t velocity, uint8_t note) {
+  if (!events_.Push({NoteEvent::Type::kNoteOn, note, velocity, ts}))
+    MODFM_TRACE(TraceEvent::kEventQueueFull, note);
+}
+
+void Player::NoteOff(unsigned long ts, uint8_t note) {
+  if (!events_.Push({NoteEvent::Type::kNoteOff, note, 0, ts}))
+    MODFM_TRACE(TraceEvent::kEventQueueFull, note);
+}
+
+void Player::ControlChange(unsigned long ts, uint8_t controller,
+                           uint8_t value) {
+  if (!events_.Push({NoteEvent::Type::kControlChange, controller, value, ts}))
+    MODFM_TRACE(TraceEvent::kEventQueueFull, controller);
+}
+
+void Player::ProgramChange(unsigned long ts, uint8_t program) {
+  if (!events_.Push({NoteEvent::Type::kProgramChange, program, 0, ts}))
+    MODFM_TRACE(TraceEvent::kEventQueueFull, program);
+}
+
+void Player::SetPatchBank(const PatchBank *bank) {
   std::lock_guard<std::mutex> player_lock(voices_mutex_);
+  // Voices playing a program are let go by the next block.
+  bank_ = bank;
+  program_ = -1;
+  range_version_ = std::numeric_limits<uint64_t>::max();
+  program_banks_.clear();
+  program_snapshot_.generators.clear();
+  if (!bank) return;
+
+  Generator generator(sample_frequency_);
+  Configure(generator);
+  for (int g = 0; g < bank->max_generators(); g++)
+    program_banks_.emplace_back(num_voices_, generator);
+  program_snapshot_.generators.reserve(bank->max_generators());
+  tasks_.reserve(num_voices_ * std::max<size_t>(bank->max_generators(),
+                                                layout_->banks.size()));
+  LOG(INFO) << "Patch bank of " << bank->num_programs() << " programs";
+}
+
+void Player::SelectProgram(uint8_t program_change) {
+  const int bank_select = std::lround(controllers_[0] * 127.0f) * 128 +
+                          std::lround(controllers_[32] * 127.0f);
+  const int program = bank_select * 128 + (program_change & 0x7f);
+  std::span<const PatchBank::Generator> generators;
+  if (bank_) generators = bank_->generators(program);
+  if (generators.empty()) {
+    MODFM_TRACE(TraceEvent::kProgramChange, program_change, -1, program);
+    return;
+  }
+  MODFM_TRACE(TraceEvent::kProgramChange, program_change, generators.size(),
+              program);
+  // The live patch's generators are left behind, so can't carry on.
+  if (program_ < 0) {
+    for (auto &bank : layout_->banks) {
+      for (int v = 0; v < num_voices_; v++) bank[v].Stop();
+    }
+  }
+  // Within the capacity reserved by SetPatchBank(), so never allocates.
+  program_snapshot_.generators.resize(generators.size());
+  for (size_t g = 0; g < generators.size(); g++)
+    PatchBank::Load(generators[g], &program_snapshot_.generators[g]);
+  for (size_t g = generators.size(); g < program_banks_.size(); g++) {
+    for (int v = 0; v < num_voices_; v++) program_banks_[g][v].Stop();
+  }
+  program_ = program;
+  // Ranges and oversampling follow as for a patch edit.
+  range_version_ = std::numeric_limits<uint64_t>::max();
+}
+
+void Player::Reset() {
+  std::lock_guard<std::mutex> player_lock(voices_mutex_);
+  ForEachGenerator([](Generator &g) { g.Reset(); });
+  program_ = -1;
+  range_version_ = std::numeric_limits<uint64_t>::max();
+  free_voices_.clear();
+  for (int i = num_voices_ - 1; i >= 0; i--) free_voices_.push_back(i);
+  for (auto &voice : voices_) voice.prev = voice.next = -1;
+  active_head_ = active_tail_ = -1;
+  num_active_voices_ = 0;
+  note_voices_.fill(-1);
+  controllers_.fill(0.0f);
+  NoteEvent event;
+  while (events_.Pop(&event)) {
+  }
+  num_pending_ = 0;
+}
+
+void Player::SetDeadline(double fraction) { deadline_fraction_ = fraction; }
+
+void Player::SetEventLatency(double latency_ms) {
+  event_latency_ms_ = latency_ms;
+}
 
+void Player::ScheduleEvents(size_t frames_per_buffer,
+                            std::optional<double> block_time_ms) {
+  const double frames_per_ms = sample_frequency_ / 1000.0;
+  // Far future timestamps (a clock mismatch, most likely) would hold up every
+  // event behind them.
+  const double max_offset =
+      frames_per_buffer + event_latency_ms_ * frames_per_ms;
+  uint64_t earliest =
+      num_pending_ ? pending_[num_pending_ - 1].frame : frame_;
+  NoteEvent event;
+  while (num_pending_ < pending_.size() && events_.Pop(&event)) {
+    uint64_t frame = frame_;
+    if (block_time_ms) {
+      double offset =
+          (event.ts + event_latency_ms_ - *block_time_ms) * frames_per_ms;
+      // Late events play as soon as possible.
+      frame += static_cast<uint64_t>(std::clamp(offset, 0.0, max_offset));
+    }
+    // Never reorder events.
+    earliest = std::max(earliest, frame);
+    pending_[num_pending_++] = {event, earliest};
+  }
+}
+
+void Player::ApplyEvent(const PatchSnapshot &snapshot,
+                        const NoteEvent &event) {
+  switch (event.type) {
+    case NoteEvent::Type::kNoteOn:
+      StartNote(snapshot, event.ts, event.velocity, event.note);
+      break;
+    case NoteEvent::Type::kNoteOff:
+      StopNote(snapshot, event.note);
+      break;
+    case NoteEvent::Type::kControlChange:
+      controllers_[event.note & 0x7f] = event.velocity / 127.0f;
+      break;
+    case NoteEvent::Type::kProgramChange:
+      SelectProgram(event.note);
+      break;
+  }
+}
+
+void Player::StartNote(const PatchSnapshot &snapshot, unsigned long ts,
+                       uint8_t velocity, uint8_t note) {
   // A note with no velocity is not a note at all.
   if (!velocity)
     return;
 
   float base_freq = NoteToFreq(note);
-  float vel = (float)velocity / 80;
 
-  Voice *v = NewVoice();
-  CHECK(v) << "No voice available";
-  v->note = note;
-  v->on_time = ts;
-  v->base_freq = base_freq;
-  v->velocity = vel;
-
-  auto generators = patch_->generators();
-  for (int g_num = 0; g_num < v->generators_.size(); g_num++) {
-    auto &g = v->generators_[g_num];
-    auto &gp = generators[g_num];
-    g->NoteOn(*gp, ts, velocity, note);
+  int v = NewVoice(snapshot, note);
+  if (v == -1) {
+    MODFM_TRACE(TraceEvent::kNoVoice, note);
+    return;
+  }
+  voices_[v].note = note;
+  voices_[v].base_freq = base_freq;
+  voices_[v].velocity = velocity;
+
+  for (auto &pending : layout_->pending) pending[v] = false;
+  auto &banks = CurrentBanks();
+  for (int g_num = 0; g_num < banks.size(); g_num++) {
+    Generator &g = banks[g_num][v];
+    if (const auto *gp = PatchFor(snapshot, g_num)) {
+      g.NoteOn(*gp, ts, velocity, note);
+      g.UpdateRange(*gp, base_freq);
+    } else if (program_ < 0) {
+      // Whatever a stolen voice had playing here stops with the rest of it.
+      g.Stop();
+      layout_->pending[g_num][v] = true;
+    }
   }
   // TODO legato, portamento, etc.
 }
 
-void Player::NoteOff(uint8_t note) {
-  std::lock_guard<std::mutex> player_lock(voices_mutex_);
-  auto gp_patches = patch_->generators();
-
+void Player::StopNote(const PatchSnapshot &snapshot, uint8_t note) {
   // Find the oscillator playing this and send it a note-off event.
-  auto *v = VoiceFor(note);
-  if (v == nullptr) {
-    LOG(ERROR) << "Unable to find voice for: " << std::hex << note;
+  int v = VoiceFor(note);
+  if (v == -1) {
+    MODFM_TRACE(TraceEvent::kUnmatchedNoteOff, note);
     return;
   }
-  for (int g_num = 0; g_num < v->generators_.size(); g_num++) {
-    auto &g = v->generators_[g_num];
-    auto &gp = *gp_patches[g_num];
-    g->NoteOff(gp, note);
+  note_voices_[note] = -1;
+  // Released before it ever started.
+  for (auto &pending : layout_->pending) pending[v] = false;
+  auto &banks = CurrentBanks();
+  for (int g_num = 0; g_num < banks.size(); g_num++) {
+    Generator &g = banks[g_num][v];
+    if (const auto *gp = PatchFor(snapshot, g_num))
+      g.NoteOff(*gp, note);
+    else
+      g.Stop();
   }
 }
 
-Player::Voice *Player::NewVoice() {
-  for (auto &v : voices_) {
-    if (!v.Playing())
-      return &v;
-  }
+void Player::SetQuality(Oscillator::Quality quality) {
+  std::lock_guard<std::mutex> player_lock(voices_mutex_);
+  quality_ = quality;
+  ForEachGenerator([quality](Generator &g) { g.SetQuality(quality); });
+  LOG(INFO) << "Oscillator quality: " << Oscillator::QualityName(quality);
+}
 
-  // No free voice? Find the one with the lowest timestamp and steal it.
-  unsigned long least_ts = INT_MAX;
-  int stolen_voice_num = -1;
-  for (int i = 0; i < num_voices_; i++) {
-    if (voices_[i].on_time < least_ts) {
-      stolen_voice_num = i;
-      least_ts = voices_[i].on_time;
-    }
-  }
-  if (stolen_voice_num == -1) {
-    LOG(INFO) << "No voice to steal";
-    return nullptr;
-  }
+void Player::SetAudibilityThreshold(float db) {
+  std::lock_guard<std::mutex> player_lock(voices_mutex_);
+  audibility_threshold_ = std::pow(10.0f, db / 20.0f);
+}
 
-  Voice &voice = voices_[stolen_voice_num];
-  return &voice;
+void Player::SetControlPeriod(size_t frames) {
+  CHECK_GT(frames, 0);
+  std::lock_guard<std::mutex> player_lock(voices_mutex_);
+  control_period_ = frames;
+  ForEachGenerator([frames](Generator &g) { g.SetControlPeriod(frames); });
 }
 
-Player::Voice *Player::VoiceFor(uint8_t note) {
-  for (auto &v : voices_) {
-    if (v.note == note && v.Playing())
-      return &v;
+void Player::SetIndexClamping(bool clamp) {
+  std::lock_guard<std::mutex> player_lock(voices_mutex_);
+  clamp_index_ = clamp;
+  ForEachGenerator([clamp](Generator &g) { g.SetIndexClamping(clamp); });
+  // Picked up by the next block's range update.
+  range_version_ = std::numeric_limits<uint64_t>::max();
+}
+
+void Player::SetMaxOversampling(int factor) {
+  CHECK(factor == 1 || factor == 2 || factor == 4)
+      << "Unsupported oversampling factor: " << factor;
+  std::lock_guard<std::mutex> player_lock(voices_mutex_);
+  max_oversampling_ = factor;
+  ForEachGenerator([factor](Generator &g) { g.SetMaxOversampling(factor); });
+}
+
+int Player::NewVoice(const PatchSnapshot &snapshot, uint8_t note) {
+  // Retriggering a held note lets the old voice go rather than leave it
+  // sounding with nothing left to stop it.
+  if (note_voices_[note] != -1)
+    StopNote(snapshot, note);
+
+  int v;
+  if (!free_voices_.empty()) {
+    v = free_voices_.back();
+    free_voices_.pop_back();
+  } else {
+    // No free voice? Steal the one started longest ago.
+    v = active_head_;
+    if (v == -1)
+      return -1;
+    Voice &voice = voices_[v];
+    MODFM_TRACE(TraceEvent::kVoiceSteal, note, v, voice.note);
+    if (note_voices_[voice.note] == v)
+      note_voices_[voice.note] = -1;
+    UnlinkVoice(v);
   }
-  return nullptr;
+  LinkVoice(v);
+  note_voices_[note] = v;
+  return v;
 }
 
-bool Player::Voice::Playing() const {
-  for (const auto &g : generators_) {
-    if (g->Playing())
+int Player::VoiceFor(uint8_t note) const { return note_voices_[note]; }
+
+bool Player::VoicePlaying(int v) const {
+  for (const auto &bank : program_ >= 0 ? program_banks_ : layout_->banks) {
+    if (bank[v].Playing())
       return true;
   }
+  if (program_ < 0) {
+    for (const auto &pending : layout_->pending) {
+      if (pending[v]) return true;
+    }
+  }
   return false;
 }
 
+void Player::LinkVoice(int v) {
+  Voice &voice = voices_[v];
+  voice.prev = active_tail_;
+  voice.next = -1;
+  if (active_tail_ != -1)
+    voices_[active_tail_].next = v;
+  else
+    active_head_ = v;
+  active_tail_ = v;
+  num_active_voices_++;
+}
+
+void Player::UnlinkVoice(int v) {
+  Voice &voice = voices_[v];
+  if (voice.prev != -1)
+    voices_[voice.prev].next = voice.next;
+  else
+    active_head_ = voice.next;
+  if (voice.next != -1)
+    voices_[voice.next].prev = voice.prev;
+  else
+    active_tail_ = voice.prev;
+  voice.prev = voice.next = -1;
+  num_active_voices_--;
+}
+
+void Player::ReleaseFinishedVoices() {
+  for (int v = active_head_; v != -1;) {
+    int next = voices_[v].next;
+    if (!VoicePlaying(v)) {
+      if (note_voices_[voices_[v].note] == v)
+        note_voices_[voices_[v].note] = -1;
+      UnlinkVoice(v);
+      free_voices_.push_back(v);
+    }
+    v = next;
+  }
+}
+
 Generator::Generator(int sample_frequency)
     : sample_frequency_(sample_frequency), e_a_(sample_frequency),
-      e_k_(sample_frequency) {}
+      e_k_(sample_frequency) {
+  decimator_.SetLatency(Decimator::Delay(max_oversampling_));
+}
+
+void Generator::SetMaxOversampling(int factor) {
+  max_oversampling_ = factor;
+  decimator_.SetLatency(
+      Decimator::Delay(std::max(min_oversampling_, max_oversampling_)));
+}
+
+void Generator::SetMinOversampling(int factor) {
+  min_oversampling_ = factor;
+  decimator_.SetLatency(
+      Decimator::Delay(std::max(min_oversampling_, max_oversampling_)));
+}
 
-void Generator::Perform(const GeneratorPatch &patch,
-                        std::complex<float> *out_buffer, float base_freq,
+void Generator::Perform(const PatchSnapshot::Generator &patch,
+                        float *mix_buffer, float base_freq,
+                        const ControllerValues &controllers,
                         size_t frames_per_buffer) {
-  std::vector<float> level_a(frames_per_buffer, 0.0f);
-  std::vector<float> level_k(frames_per_buffer, 0.0f);
-  std::vector<float> level_c(frames_per_buffer, 0.0f);
-  std::vector<float> level_r(frames_per_buffer, 0.0f);
-  std::vector<float> level_s(frames_per_buffer, 0.0f);
-  std::vector<float> level_m(frames_per_buffer, 0.0f);
-
-  patch.WithLock([&level_c, &level_m, &level_s, &level_r, &level_k, &level_a,
-                  this,
-                  &frames_per_buffer](const GeneratorPatch::Osc &osc,
-                                      const GeneratorPatch::Envelope &a_env,
-                                      const GeneratorPatch::Envelope &k_env) {
-    std::fill(level_c.begin(), level_c.begin() + frames_per_buffer, osc.C);
-    std::fill(level_r.begin(), level_r.begin() + frames_per_buffer, osc.R);
-    std::fill(level_s.begin(), level_s.begin() + frames_per_buffer, osc.S);
-    std::fill(level_m.begin(), level_m.begin() + frames_per_buffer, osc.M);
-    std::fill(level_a.begin(), level_a.begin() + frames_per_buffer, osc.A);
-    std::fill(level_k.begin(), level_k.begin() + frames_per_buffer, osc.K);
-    for (int i = 0; i < frames_per_buffer; i++) {
-      level_a[i] *= e_a_.NextSample(a_env);
-      level_k[i] *= e_k_.NextSample(k_env);
+  const auto a_program = EnvelopeProgram::FromEnvelope(patch.a_env);
+  const auto k_program = EnvelopeProgram::FromEnvelope(patch.k_env);
+  const bool modulated = patch.modulation.num_routes > 0;
+  // Integer ratio generators can skip the formula entirely, unless something
+  // is moving the ratios or the shape.
+  const Wavetable *wavetable = patch.wavetable.get();
+  if (o_.quality() == Oscillator::Quality::kReference || modulated)
+    wavetable = nullptr;
+
+  // Tables are already band limited.
+  if (!wavetable && choose_oversampling_) {
+    const int factor = OversamplingFor(patch, k_program, base_freq);
+    if (factor != oversampling_) decimator_.Reset();
+    oversampling_ = factor;
+    choose_oversampling_ = false;
+  }
+
+  // Envelopes, oscillator and mix run a chunk at a time so the per-frame
+  // levels never leave the stack. Modulated generators also end chunks on
+  // control ticks.
+  alignas(64) float level_a[Oscillator::kChunkFrames];
+  alignas(64) float level_k[Oscillator::kChunkFrames];
+  size_t frames;
+  for (size_t start = 0; start < frames_per_buffer; start += frames) {
+    MODFM_TRACE_OFFSET(start);
+    frames = std::min(Oscillator::kChunkFrames, frames_per_buffer - start);
+    if (!modulated) {
+      // Routes added mid-note start from their targets.
+      snap_ = true;
+      control_countdown_ = 0;
+      const auto &osc = patch.osc;
+      e_a_.Render(a_program, osc.A, level_a, frames);
+      e_k_.Render(k_program, osc.K, level_k, frames);
+      ClampIndex(level_k, frames);
+      if (wavetable && !latency()) {
+        o_.PerformWavetable(*wavetable, frames, sample_frequency_,
+                            mix_buffer + start, base_freq, level_a, level_k);
+      } else if (wavetable) {
+        // Delayed along with the oversampled generators.
+        alignas(64) float out[Oscillator::kChunkFrames] = {};
+        o_.PerformWavetable(*wavetable, frames, sample_frequency_, out,
+                            base_freq, level_a, level_k);
+        decimator_.Process(1, out, out, frames);
+        for (size_t i = 0; i < frames; i++) mix_buffer[start + i] += out[i];
+      } else {
+        PerformOversampled(frames, mix_buffer + start, base_freq, osc, {},
+                           level_a, level_k);
+      }
+      continue;
     }
-  });
-  o_.Perform(frames_per_buffer, sample_frequency_, out_buffer, base_freq,
-             level_a.data(), level_c.data(), level_m.data(), level_r.data(),
-             level_s.data(), level_k.data());
+
+    if (control_countdown_ == 0) ControlTick(patch, controllers);
+    frames = std::min(frames, control_countdown_);
+    control_countdown_ -= frames;
+    // Only ramps that are actually moving cost a pass over the levels.
+    e_a_.Render(a_program, step_.A != 0.0f ? 1.0f : current_.A, level_a,
+                frames);
+    e_k_.Render(k_program, step_.K != 0.0f ? 1.0f : current_.K, level_k,
+                frames);
+    if (step_.A != 0.0f) {
+      for (size_t i = 0; i < frames; i++)
+        level_a[i] *= current_.A + step_.A * i;
+    }
+    if (step_.K != 0.0f) {
+      for (size_t i = 0; i < frames; i++)
+        level_k[i] *= current_.K + step_.K * i;
+    }
+    ClampIndex(level_k, frames);
+    PerformOversampled(frames, mix_buffer + start, base_freq, current_, step_,
+                       level_a, level_k);
+    current_.C += step_.C * frames;
+    current_.A += step_.A * frames;
+    current_.M += step_.M * frames;
+    current_.K += step_.K * frames;
+    current_.R += step_.R * frames;
+    current_.S += step_.S * frames;
+  }
 }
 
-void Generator::NoteOn(const GeneratorPatch &patch, unsigned long ts,
-                       uint8_t velocity, uint8_t note) {
-  patch.WithLock([this](const GeneratorPatch::Osc &osc,
-                        const GeneratorPatch::Envelope &a_env,
-                        const GeneratorPatch::Envelope &k_env) {
-    e_a_.EnterStage(EnvelopeGenerator::ENVELOPE_STAGE_ATTACK, a_env);
-    e_k_.EnterStage(EnvelopeGenerator::ENVELOPE_STAGE_ATTACK, k_env);
-  });
+void Generator::ClampIndex(float level_k[], size_t frames) const {
+  if (k_limit_ == std::numeric_limits<float>::infinity()) return;
+  for (size_t i = 0; i < frames; i++)
+    level_k[i] = std::clamp(level_k[i], -k_limit_, k_limit_);
 }
 
-void Generator::NoteOff(const GeneratorPatch &patch, uint8_t note) {
-  patch.WithLock([this](const GeneratorPatch::Osc &osc,
-                        const GeneratorPatch::Envelope &a_env,
-                        const GeneratorPatch::Envelope &k_env) {
-    if (e_a_.Playing())
-      e_a_.EnterStage(EnvelopeGenerator::ENVELOPE_STAGE_RELEASE, a_env);
-    if (e_k_.Playing())
-      e_k_.EnterStage(EnvelopeGenerator::ENVELOPE_STAGE_RELEASE, k_env);
-  });
+int Generator::OversamplingFor(const PatchSnapshot::Generator &patch,
+                               const EnvelopeProgram &k_program,
+                               float base_freq) const {
+  const auto peak = PeakOsc(patch);
+  const float k = std::min(peak.K * e_k_.Ceiling(k_program), k_limit_);
+  const float bandwidth = Bandwidth(peak, k, base_freq);
+  // At factor n, whatever lies below (2n - 1) times Nyquist folds back no
+  // lower than Nyquist, where the decimator takes it out.
+  const float nyquist = 0.5f * sample_frequency_;
+  int factor = 4;
+  if (bandwidth < nyquist)
+    factor = 1;
+  else if (bandwidth < 3.0f * nyquist)
+    factor = 2;
+  return std::max(std::min(factor, max_oversampling_), min_oversampling_);
+}
+
+void Generator::PerformOversampled(size_t frames,
+                                   float *mix_buffer,
+                                   float base_freq,
+                                   const GeneratorPatch::Osc &osc,
+                                   const GeneratorPatch::Osc &step,
+                                   const float level_a[],
+                                   const float level_k[]) {
+  const int factor = oversampling_;
+  if (factor == 1 && !latency()) {
+    o_.Perform(frames, sample_frequency_, mix_buffer, base_freq, osc, step,
+               level_a, level_k);
+  } else if (factor == 1) {
+    // Delayed along with the oversampled generators.
+    alignas(64) float out[Oscillator::kChunkFrames] = {};
+    o_.Perform(frames, sample_frequency_, out, base_freq, osc, step, level_a,
+               level_k);
+    decimator_.Process(1, out, out, frames);
+    for (size_t i = 0; i < frames; i++) mix_buffer[i] += out[i];
+  } else {
+    constexpr size_t kMaxFrames =
+        Oscillator::kChunkFrames * Decimator::kMaxFactor;
+    alignas(64) float os_level_a[kMaxFrames];
+    alignas(64) float os_level_k[kMaxFrames];
+    alignas(64) float os_out[kMaxFrames];
+    alignas(64) float out[Oscillator::kChunkFrames];
+    // Levels ramp linearly from one output frame to the next, and the last
+    // oversampled frame of each lines up with it.
+    const float inv_factor = 1.0f / factor;
+    float a = last_level_a_, k = last_level_k_;
+    for (size_t i = 0; i < frames; i++) {
+      const float da = (level_a[i] - a) * inv_factor;
+      const float dk = (level_k[i] - k) * inv_factor;
+      for (int j = 0; j < factor; j++) {
+        os_level_a[i * factor + j] = a + da * (j + 1);
+        os_level_k[i * factor + j] = k + dk * (j + 1);
+      }
+      a = level_a[i];
+      k = level_k[i];
+    }
+    const GeneratorPatch::Osc os_step{step.C * inv_factor, 0.0f,
+                                      step.M * inv_factor, 0.0f,
+                                      step.R * inv_factor, step.S * inv_factor};
+    const size_t os_frames = frames * factor;
+    std::fill(os_out, os_out + os_frames, 0.0f);
+    o_.Perform(os_frames, sample_frequency_ * factor, os_out, base_freq, osc,
+               os_step, os_level_a, os_level_k);
+    decimator_.Process(factor, os_out, out, frames);
+    for (size_t i = 0; i < frames; i++) mix_buffer[i] += out[i];
+  }
+  last_level_a_ = level_a[frames - 1];
+  last_level_k_ = level_k[frames - 1];
+}
+
+void Generator::ControlTick(const PatchSnapshot::Generator &patch,
+                            const ControllerValues &controllers) {
+  using Source = GeneratorPatch::Modulation::Source;
+  const auto &modulation = patch.modulation;
+
+  float lfos[GeneratorPatch::Modulation::kNumLFOs];
+  for (int i = 0; i < GeneratorPatch::Modulation::kNumLFOs; i++) {
+    lfos[i] = LFOValue(modulation.lfos[i].shape, lfo_phases_[i]);
+    lfo_phases_[i] += static_cast<double>(modulation.lfos[i].rate) *
+                      control_period_ / sample_frequency_;
+    lfo_phases_[i] -= std::floor(lfo_phases_[i]);
+  }
+
+  GeneratorPatch::Osc target = patch.osc;
+  for (int i = 0; i < modulation.num_routes; i++) {
+    const auto &route = modulation.routes[i];
+    float value = 0.0f;
+    switch (route.source) {
+      case Source::kLFO1:
+        value = lfos[0];
+        break;
+      case Source::kLFO2:
+        value = lfos[1];
+        break;
+      case Source::kAmpEnvelope:
+        value = e_a_.level();
+        break;
+      case Source::kModEnvelope:
+        value = e_k_.level();
+        break;
+      case Source::kVelocity:
+        value = velocity_;
+        break;
+      case Source::kCC:
+        value = controllers[route.cc & 0x7f];
+        break;
+    }
+    OscParam(target, route.target) += route.depth * value;
+  }
+
+  if (snap_) {
+    current_ = target;
+    step_ = {};
+    snap_ = false;
+  } else {
+    const float inv_period = 1.0f / control_period_;
+    step_.C = (target.C - current_.C) * inv_period;
+    step_.A = (target.A - current_.A) * inv_period;
+    step_.M = (target.M - current_.M) * inv_period;
+    step_.K = (target.K - current_.K) * inv_period;
+    step_.R = (target.R - current_.R) * inv_period;
+    step_.S = (target.S - current_.S) * inv_period;
+  }
+  control_countdown_ = control_period_;
+}
+
+void Generator::NoteOn(const PatchSnapshot::Generator &patch,
+                       unsigned long ts, uint8_t velocity, uint8_t note) {
+  e_a_.NoteOn(EnvelopeProgram::FromEnvelope(patch.a_env));
+  e_k_.NoteOn(EnvelopeProgram::FromEnvelope(patch.k_env));
+  velocity_ = velocity / 127.0f;
+  lfo_phases_ = {};
+  control_countdown_ = 0;
+  snap_ = true;
+  choose_oversampling_ = true;
+}
+
+void Generator::NoteOff(const PatchSnapshot::Generator &patch, uint8_t note) {
+  e_a_.NoteOff(EnvelopeProgram::FromEnvelope(patch.a_env));
+  e_k_.NoteOff(EnvelopeProgram::FromEnvelope(patch.k_env));
 }
 
 bool Generator::Playing() const { return e_a_.Playing(); }
 
+void Generator::UpdateRange(const PatchSnapshot::Generator &patch,
+                            float base_freq) {
+  const auto peak = PeakOsc(patch);
+  const float nyquist = 0.5f * sample_frequency_;
+  const float carrier = peak.C * base_freq;
+
+  // Sideband count that keeps the highest one below Nyquist. Clamping can't
+  // help once the carrier itself is past it; oversampling takes over there.
+  k_limit_ = std::numeric_limits<float>::infinity();
+  const float spacing = carrier * peak.M;
+  if (clamp_index_ && peak.R + peak.S > 0.0f && spacing > 0.0f) {
+    const float sidebands = (nyquist - carrier) / spacing;
+    if (sidebands >= 1.0f)
+      k_limit_ = (sidebands - 1.0f) / (peak.R + peak.S);
+  }
+
+  // Routes can pull the carrier down by their depth on C; the sidebands
+  // below it reach at most Sidebands() modulator spacings further.
+  float lowest_c = std::fabs(patch.osc.C);
+  for (int i = 0; i < patch.modulation.num_routes; i++) {
+    const auto &route = patch.modulation.routes[i];
+    if (route.target == GeneratorPatch::Modulation::Target::kC)
+      lowest_c -= std::fabs(route.depth);
+  }
+  const auto k_program = EnvelopeProgram::FromEnvelope(patch.k_env);
+  const float k = std::min(peak.K * e_k_.Ceiling(k_program), k_limit_);
+  const float lowest = lowest_c * base_freq - spacing * Sidebands(peak, k);
+  ultrasonic_ = lowest > nyquist;
+}
+
+bool Generator::Cull(const PatchSnapshot::Generator &patch, float threshold) {
+  // Output never exceeds A times the amplitude envelope. A route can add its
+  // depth times the most its source can reach to A: 1 for most sources, but
+  // envelopes go as high as their highest segment level.
+  using Source = GeneratorPatch::Modulation::Source;
+  const float a_ceiling =
+      e_a_.Ceiling(EnvelopeProgram::FromEnvelope(patch.a_env));
+  const float k_ceiling =
+      e_k_.Ceiling(EnvelopeProgram::FromEnvelope(patch.k_env));
+  float amplitude = std::fabs(patch.osc.A);
+  const auto &modulation = patch.modulation;
+  for (int i = 0; i < modulation.num_routes; i++) {
+    const auto &route = modulation.routes[i];
+    if (route.target != GeneratorPatch::Modulation::Target::kA) continue;
+    float reach = 1.0f;
+    if (route.source == Source::kAmpEnvelope)
+      reach = std::max(reach, a_ceiling);
+    else if (route.source == Source::kModEnvelope)
+      reach = std::max(reach, k_ceiling);
+    amplitude += std::fabs(route.depth) * reach;
+  }
+  if (amplitude * a_ceiling >= threshold)
+    return false;
+  Stop();
+  return true;
+}
+
+void Generator::Skip(const PatchSnapshot::Generator &patch, size_t frames) {
+  e_a_.Skip(EnvelopeProgram::FromEnvelope(patch.a_env), frames);
+  e_k_.Skip(EnvelopeProgram::FromEnvelope(patch.k_env), frames);
+  const auto &lfos = patch.modulation.lfos;
+  for (int i = 0; i < GeneratorPatch::Modulation::kNumLFOs; i++) {
+    lfo_phases_[i] +=
+        static_cast<double>(lfos[i].rate) * frames / sample_frequency_;
+    lfo_phases_[i] -= std::floor(lfo_phases_[i]);
+  }
+  snap_ = true;
+  control_countdown_ = 0;
+  choose_oversampling_ = true;
+  decimator_.Reset();
+}
+
 void Generator::Stop() {
-  e_a_.EnterStage(EnvelopeGenerator::ENVELOPE_STAGE_OFF, {});
-  e_k_.EnterStage(EnvelopeGenerator::ENVELOPE_STAGE_OFF, {});
+  e_a_.Stop();
+  e_k_.Stop();
+}
+
+void Generator::Reset() {
+  Stop();
+  o_.Reset();
+  control_countdown_ = 0;
+  snap_ = true;
+  velocity_ = 0.0f;
+  lfo_phases_ = {};
+  current_ = {};
+  step_ = {};
+  oversampling_ = 1;
+  choose_oversampling_ = true;
+  decimator_.Reset();
+  k_limit_ = std::numeric_limits<float>::infinity();
+  ultrasonic_ = false;
+  last_level_a_ = last_level_k_ = 0.0f;
 }
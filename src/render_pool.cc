@@ -0,0 +1,171 @@
+#include "render_pool.h"
+
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <mutex>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include "allocation_guard.h"
+
+namespace {
+
+// How long an idle worker polls for the next block before going to sleep.
+constexpr int kSpinIterations = 4096;
+
+inline void CpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#endif
+}
+
+// Cores held by some pool's helpers, across every pool in the process. Core
+// 0 is left to the threads calling Run().
+std::mutex cpus_mutex;
+std::vector<bool> cpus_taken;
+
+// A free core, or -1 if there is none.
+int ClaimCpu() {
+  std::lock_guard<std::mutex> lock(cpus_mutex);
+  cpus_taken.resize(std::thread::hardware_concurrency());
+  for (size_t cpu = 1; cpu < cpus_taken.size(); cpu++) {
+    if (!cpus_taken[cpu]) {
+      cpus_taken[cpu] = true;
+      return cpu;
+    }
+  }
+  return -1;
+}
+
+void ReleaseCpu(int cpu) {
+  std::lock_guard<std::mutex> lock(cpus_mutex);
+  cpus_taken[cpu] = false;
+}
+
+void Pin(std::thread &thread, int cpu) {
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  if (pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set))
+    LOG(WARNING) << "Unable to pin render worker to CPU " << cpu;
+  sched_param param{};
+  param.sched_priority = sched_get_priority_max(SCHED_FIFO) / 2;
+  if (pthread_setschedparam(thread.native_handle(), SCHED_FIFO, &param))
+    LOG(INFO) << "Render workers run without real time priority";
+#endif
+}
+
+}  // namespace
+
+RenderPool::RenderPool(int num_workers, size_t max_frames) {
+  if (num_workers <= 0)
+    num_workers = std::max(1u, std::thread::hardware_concurrency()) - 1;
+  num_workers = std::max(num_workers, 1);
+  for (int i = 0; i < num_workers; i++) {
+    workers_.push_back(std::make_unique<Worker>());
+    if (i > 0) workers_.back()->buffer = AlignedBuffer<float>(max_frames);
+  }
+  for (int i = 1; i < num_workers; i++) {
+    workers_[i]->thread = std::thread([this, i] { WorkerLoop(i); });
+    const int cpu = ClaimCpu();
+    if (cpu < 0) continue;
+    cpus_.push_back(cpu);
+    Pin(workers_[i]->thread, cpu);
+  }
+  LOG(INFO) << "Render workers: " << num_workers;
+}
+
+RenderPool::~RenderPool() {
+  stopping_ = true;
+  generation_.fetch_add(1, std::memory_order_release);
+  generation_.notify_all();
+  for (auto &w : workers_) {
+    if (w->thread.joinable()) w->thread.join();
+  }
+  for (int cpu : cpus_) ReleaseCpu(cpu);
+}
+
+size_t RenderPool::RunTasks(size_t num_tasks, size_t frames,
+                            Clock::time_point deadline, float *out,
+                            void *task, TaskFn fn) {
+  const size_t num_workers = workers_.size();
+  for (size_t w = 0; w < num_workers; w++) {
+    workers_[w]->next.store(num_tasks * w / num_workers,
+                            std::memory_order_relaxed);
+    workers_[w]->end = num_tasks * (w + 1) / num_workers;
+    workers_[w]->used = false;
+  }
+  // Worker 0's buffer is `out`, cleared here whether or not any task runs.
+  std::fill(out, out + frames, 0.0f);
+  workers_[0]->used = true;
+  if (num_tasks == 0) return 0;
+  task_ = task;
+  task_fn_ = fn;
+  frames_ = frames;
+  out_ = out;
+  deadline_ = deadline;
+  skipped_.store(0, std::memory_order_relaxed);
+
+  // Not worth waking anyone for a single task.
+  if (num_tasks > 1 && num_workers > 1) {
+    busy_workers_.store(num_workers - 1, std::memory_order_relaxed);
+    generation_.fetch_add(1, std::memory_order_release);
+    generation_.notify_all();
+    Work(0);
+    while (busy_workers_.load(std::memory_order_acquire) != 0) CpuRelax();
+    for (size_t w = 1; w < num_workers; w++) {
+      if (!workers_[w]->used) continue;
+      const float *buffer = workers_[w]->buffer.data();
+      for (size_t i = 0; i < frames; i++) out[i] += buffer[i];
+    }
+  } else {
+    workers_[0]->end = num_tasks;
+    for (size_t w = 1; w < num_workers; w++) workers_[w]->end = 0;
+    Work(0);
+  }
+  return skipped_.load(std::memory_order_relaxed);
+}
+
+void RenderPool::Work(int worker_num) {
+  Worker &self = *workers_[worker_num];
+  const int num_workers = workers_.size();
+  // Own share first, then everyone else's.
+  for (int i = 0; i < num_workers; i++) {
+    Worker &victim = *workers_[(worker_num + i) % num_workers];
+    for (;;) {
+      size_t task = victim.next.fetch_add(1, std::memory_order_relaxed);
+      if (task >= victim.end) break;
+      if (Clock::now() > deadline_) {
+        skipped_.fetch_add(1, std::memory_order_relaxed);
+        continue;
+      }
+      if (!self.used) {
+        std::fill(self.buffer.data(), self.buffer.data() + frames_, 0.0f);
+        self.used = true;
+      }
+      task_fn_(task_, task, worker_num == 0 ? out_ : self.buffer.data());
+    }
+  }
+}
+
+void RenderPool::WorkerLoop(int worker_num) {
+  ScopedAllocationGuard no_allocations;
+  uint64_t seen = 0;
+  for (;;) {
+    for (int i = 0; i < kSpinIterations &&
+                    generation_.load(std::memory_order_acquire) == seen;
+         i++) {
+      CpuRelax();
+    }
+    generation_.wait(seen, std::memory_order_acquire);
+    seen = generation_.load(std::memory_order_acquire);
+    if (stopping_) return;
+    Work(worker_num);
+    busy_workers_.fetch_sub(1, std::memory_order_release);
+  }
+}
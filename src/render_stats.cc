@@ -0,0 +1,70 @@
+#include "render_stats.h"
+
+#include <algorithm>
+
+namespace {
+
+// Weight of the newest buffer in the average.
+constexpr float kAverageWeight = 0.01f;
+
+}  // namespace
+
+void RenderStats::RecordBuffer(const Overrun &buffer) {
+  const float load = buffer.load;
+  const int bucket =
+      std::min<int>(load / kBucketWidth, kNumBuckets - 1);
+  histogram_[bucket].fetch_add(1, std::memory_order_relaxed);
+  buffers_.fetch_add(1, std::memory_order_relaxed);
+  last_load_.store(load, std::memory_order_relaxed);
+  if (load > peak_load_.load(std::memory_order_relaxed))
+    peak_load_.store(load, std::memory_order_relaxed);
+  const float average = average_load_.load(std::memory_order_relaxed);
+  average_load_.store(average + kAverageWeight * (load - average),
+                      std::memory_order_relaxed);
+  if (load <= 1.0f) return;
+
+  const uint32_t sequence = recent_sequence_.load(std::memory_order_relaxed);
+  recent_sequence_.store(sequence + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  const uint64_t n = overruns_.load(std::memory_order_relaxed);
+  auto &slot = recent_[n % kRecentOverruns];
+  slot.frame.store(buffer.frame, std::memory_order_relaxed);
+  slot.load.store(load, std::memory_order_relaxed);
+  slot.voices.store(buffer.voices, std::memory_order_relaxed);
+  slot.generators.store(buffer.generators, std::memory_order_relaxed);
+  slot.patch_edit.store(buffer.patch_edit, std::memory_order_relaxed);
+  overruns_.store(n + 1, std::memory_order_relaxed);
+  recent_sequence_.store(sequence + 2, std::memory_order_release);
+}
+
+RenderStats::Snapshot RenderStats::Read() const {
+  Snapshot s;
+  s.buffers = buffers_.load(std::memory_order_relaxed);
+  s.underruns = underruns_.load(std::memory_order_relaxed);
+  s.skipped_generators = skipped_.load(std::memory_order_relaxed);
+  s.last_load = last_load_.load(std::memory_order_relaxed);
+  s.peak_load = peak_load_.load(std::memory_order_relaxed);
+  s.average_load = average_load_.load(std::memory_order_relaxed);
+  for (int i = 0; i < kNumBuckets; i++)
+    s.histogram[i] = histogram_[i].load(std::memory_order_relaxed);
+
+  // Overruns are rare, so a retry is rarer still.
+  for (;;) {
+    const uint32_t before = recent_sequence_.load(std::memory_order_acquire);
+    if (before & 1) continue;
+    s.overruns = overruns_.load(std::memory_order_relaxed);
+    s.num_recent = std::min<uint64_t>(s.overruns, kRecentOverruns);
+    for (int i = 0; i < s.num_recent; i++) {
+      const auto &slot = recent_[(s.overruns - 1 - i) % kRecentOverruns];
+      auto &overrun = s.recent[i];
+      overrun.frame = slot.frame.load(std::memory_order_relaxed);
+      overrun.load = slot.load.load(std::memory_order_relaxed);
+      overrun.voices = slot.voices.load(std::memory_order_relaxed);
+      overrun.generators = slot.generators.load(std::memory_order_relaxed);
+      overrun.patch_edit = slot.patch_edit.load(std::memory_order_relaxed);
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (recent_sequence_.load(std::memory_order_relaxed) == before) break;
+  }
+  return s;
+}
@@ -0,0 +1,44 @@
+// Builds a patch bank out of text patches, one program per file in the order
+// given, named after the file.
+//
+//   modfm_bank --output=factory.mfb organ.txt bass.txt bell.txt
+//
+// The first file is program 0. Past 128 programs, reaching them over MIDI
+// takes a bank select first.
+
+#include <absl/strings/str_format.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <filesystem>
+#include <vector>
+
+#include "patch_bank.h"
+#include "patch_text.h"
+
+DEFINE_string(output, "bank.mfb", "Patch bank to write");
+
+int main(int argc, char *argv[]) {
+  FLAGS_logtostderr = true;
+  google::InitGoogleLogging(argv[0]);
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+  CHECK_GT(argc, 1) << "No patches given";
+
+  std::vector<PatchBank::Entry> programs;
+  for (int i = 1; i < argc; i++) {
+    Patch patch;
+    auto status = LoadPatchText(argv[i], &patch);
+    CHECK(status.ok()) << status;
+    std::string name = std::filesystem::path(argv[i]).stem().string();
+    name.resize(std::min(name.size(), PatchBank::kNameSize));
+    programs.push_back(PatchBank::FromPatch(patch, std::move(name)));
+  }
+
+  auto status = PatchBank::Write(FLAGS_output, programs);
+  CHECK(status.ok()) << status;
+  LOG(INFO) << absl::StrFormat("Wrote %d programs to %s", programs.size(),
+                               FLAGS_output);
+  return 0;
+}
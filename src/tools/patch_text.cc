@@ -0,0 +1,201 @@
+#include "patch_text.h"
+
+#include <fstream>
+#include <vector>
+
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_format.h"
+#include "absl/strings/str_split.h"
+
+namespace {
+
+using Modulation = GeneratorPatch::Modulation;
+
+absl::Status ParseError(int line, absl::string_view what) {
+  return absl::Status(absl::StatusCode::kInvalidArgument,
+                      absl::StrFormat("Line %d: %s", line, what));
+}
+
+bool ParseFloats(absl::string_view value, std::vector<float> *out) {
+  for (absl::string_view part : absl::StrSplit(value, ',')) {
+    float f;
+    if (!absl::SimpleAtof(part, &f)) return false;
+    out->push_back(f);
+  }
+  return true;
+}
+
+// Leaves the sustain point and loop alone; they have keys of their own.
+bool ParseEnvelope(absl::string_view value, GeneratorPatch::Envelope *env) {
+  std::vector<float> v;
+  if (!ParseFloats(value, &v) || v.size() < 5 || v.size() % 2 != 1 ||
+      v.size() > 5 + 2 * GeneratorPatch::Envelope::kMaxSegments)
+    return false;
+  env->A_R = v[0];
+  env->A_L = v[1];
+  env->D_R = v[2];
+  env->S_L = v[3];
+  env->R_R = v[4];
+  env->segments = {};
+  env->num_segments = (v.size() - 5) / 2;
+  for (int i = 0; i < env->num_segments; i++)
+    env->segments[i] = {v[6 + 2 * i], v[5 + 2 * i]};
+  return true;
+}
+
+// Segment indices count the attack and decay too.
+bool ParseSegment(absl::string_view value, int8_t *segment) {
+  int i;
+  if (!absl::SimpleAtoi(value, &i) || i < 0 ||
+      i >= 2 + GeneratorPatch::Envelope::kMaxSegments)
+    return false;
+  *segment = i;
+  return true;
+}
+
+bool ParseLoop(absl::string_view value, GeneratorPatch::Envelope *env) {
+  std::vector<absl::string_view> parts = absl::StrSplit(value, ',');
+  return parts.size() == 2 && ParseSegment(parts[0], &env->loop_start) &&
+         ParseSegment(parts[1], &env->loop_end) &&
+         env->loop_start <= env->loop_end;
+}
+
+bool ParseLFO(absl::string_view value, Modulation::LFO *lfo) {
+  std::vector<absl::string_view> parts = absl::StrSplit(value, ',');
+  if (parts.size() != 2 || !absl::SimpleAtof(parts[1], &lfo->rate))
+    return false;
+  if (parts[0] == "sine") {
+    lfo->shape = Modulation::LFO::Shape::kSine;
+  } else if (parts[0] == "triangle") {
+    lfo->shape = Modulation::LFO::Shape::kTriangle;
+  } else if (parts[0] == "saw") {
+    lfo->shape = Modulation::LFO::Shape::kSaw;
+  } else if (parts[0] == "square") {
+    lfo->shape = Modulation::LFO::Shape::kSquare;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+bool ParseRoute(absl::string_view value, Modulation::Route *route) {
+  std::vector<absl::string_view> parts = absl::StrSplit(value, ',');
+  if (parts.size() != 3 || !absl::SimpleAtof(parts[2], &route->depth))
+    return false;
+
+  absl::string_view source = parts[0];
+  route->cc = 0;
+  if (source == "lfo1") {
+    route->source = Modulation::Source::kLFO1;
+  } else if (source == "lfo2") {
+    route->source = Modulation::Source::kLFO2;
+  } else if (source == "amp_env") {
+    route->source = Modulation::Source::kAmpEnvelope;
+  } else if (source == "mod_env") {
+    route->source = Modulation::Source::kModEnvelope;
+  } else if (source == "velocity") {
+    route->source = Modulation::Source::kVelocity;
+  } else if (absl::ConsumePrefix(&source, "cc")) {
+    int cc;
+    if (!absl::SimpleAtoi(source, &cc) || cc < 0 || cc > 127) return false;
+    route->source = Modulation::Source::kCC;
+    route->cc = cc;
+  } else {
+    return false;
+  }
+
+  static constexpr std::pair<const char *, Modulation::Target> kTargets[] = {
+      {"C", Modulation::Target::kC}, {"A", Modulation::Target::kA},
+      {"M", Modulation::Target::kM}, {"K", Modulation::Target::kK},
+      {"R", Modulation::Target::kR}, {"S", Modulation::Target::kS}};
+  for (const auto &[name, target] : kTargets) {
+    if (parts[1] == name) {
+      route->target = target;
+      return true;
+    }
+  }
+  return false;
+}
+
+}  // namespace
+
+absl::Status LoadPatchText(const std::string &path, Patch *patch) {
+  std::ifstream file(path);
+  if (!file) {
+    return absl::Status(absl::StatusCode::kNotFound,
+                        absl::StrFormat("Unable to open %s", path));
+  }
+
+  std::string text;
+  for (int line_num = 1; std::getline(file, text); line_num++) {
+    absl::string_view line = text;
+    line = line.substr(0, line.find('#'));
+    std::vector<absl::string_view> tokens =
+        absl::StrSplit(line, absl::ByAnyChar(" \t\r"), absl::SkipEmpty());
+    if (tokens.empty()) continue;
+    if (tokens[0] != "generator")
+      return ParseError(line_num, "expected 'generator'");
+
+    // As Patch::AddGenerator() would set them up.
+    GeneratorPatch::Osc osc{1.0, 0.5, 1, 0, 1, 0};
+    GeneratorPatch::Envelope a_env = kDefaultAmpEnvelope;
+    GeneratorPatch::Envelope k_env = kDefaultCarEnvelope;
+    Modulation modulation;
+
+    for (size_t i = 1; i < tokens.size(); i++) {
+      std::pair<absl::string_view, absl::string_view> kv =
+          absl::StrSplit(tokens[i], absl::MaxSplits('=', 1));
+      const auto &[key, value] = kv;
+      float *param = nullptr;
+      if (key == "C") param = &osc.C;
+      if (key == "A") param = &osc.A;
+      if (key == "M") param = &osc.M;
+      if (key == "K") param = &osc.K;
+      if (key == "R") param = &osc.R;
+      if (key == "S") param = &osc.S;
+
+      bool ok;
+      if (param) {
+        ok = absl::SimpleAtof(value, param);
+      } else if (key == "a_env") {
+        ok = ParseEnvelope(value, &a_env);
+      } else if (key == "k_env") {
+        ok = ParseEnvelope(value, &k_env);
+      } else if (key == "a_sustain") {
+        ok = ParseSegment(value, &a_env.sustain);
+      } else if (key == "k_sustain") {
+        ok = ParseSegment(value, &k_env.sustain);
+      } else if (key == "a_loop") {
+        ok = ParseLoop(value, &a_env);
+      } else if (key == "k_loop") {
+        ok = ParseLoop(value, &k_env);
+      } else if (key == "lfo1") {
+        ok = ParseLFO(value, &modulation.lfos[0]);
+      } else if (key == "lfo2") {
+        ok = ParseLFO(value, &modulation.lfos[1]);
+      } else if (key == "route") {
+        if (modulation.num_routes == Modulation::kMaxRoutes)
+          return ParseError(line_num, "too many routes");
+        ok = ParseRoute(value, &modulation.routes[modulation.num_routes++]);
+      } else {
+        return ParseError(line_num,
+                          absl::StrFormat("unknown key '%s'", key));
+      }
+      if (!ok) {
+        return ParseError(line_num,
+                          absl::StrFormat("bad value for '%s'", key));
+      }
+    }
+
+    for (const auto *env : {&a_env, &k_env}) {
+      const int num_segments = 2 + env->num_segments;
+      if (env->sustain >= num_segments || env->loop_end >= num_segments)
+        return ParseError(line_num, "segment index past the envelope's end");
+    }
+
+    GeneratorPatch *generator = patch->AddGenerator();
+    generator->Update(osc, a_env, k_env);
+    generator->SetModulation(modulation);
+  }
+  return absl::OkStatus();
+}
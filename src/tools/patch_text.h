@@ -0,0 +1,27 @@
+#pragma once
+
+#include <string>
+
+#include "absl/status/status.h"
+#include "patch.h"
+
+// Patches as text, one generator per line:
+//
+//   generator C=1 A=0.5 M=1 K=2 R=1 S=0.3 a_env=0.01,1,0.1,0.5,0.3
+//       k_env=0.05,0.33,0.25,0.5,0.2 lfo1=sine,5 route=lfo1,C,0.02
+//
+// Envelopes list A_R, A_L, D_R, S_L and R_R, optionally followed by a time
+// and a level for each further segment. a_sustain and k_sustain pick the
+// segment to hold at, counting the attack as 0, and a_loop and k_loop the
+// first and last segments to repeat while the note is held:
+//
+//   a_env=0.01,1,0.1,0.5,0.3,0.2,0.8,0.2,0.5 a_loop=2,3
+//
+// LFOs are lfo1 and lfo2 with a
+// shape (sine, triangle, saw or square) and a rate in Hz. Routes take a
+// source (lfo1, lfo2, amp_env, mod_env, velocity or ccN), an Osc parameter
+// and a depth, and may repeat. Omitted keys keep the defaults of a new
+// generator. '#' starts a comment.
+//
+// Appends the generators to `patch`.
+absl::Status LoadPatchText(const std::string &path, Patch *patch);
@@ -0,0 +1,307 @@
+// Renders a Standard MIDI File through a patch to a WAV file, as fast as the
+// machine allows.
+//
+//   modfm_render --patch=organ.txt --input=song.mid --output=song.wav
+//
+// With --bank, the song's program changes select from a patch bank instead,
+// starting from --program.
+//
+// The song is cut wherever every voice has gone quiet, and the pieces are
+// rendered in parallel, each by its own Player. A song without any gaps gets
+// one Player that spreads each block over the cores instead.
+
+#include <absl/strings/str_format.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "patch_bank.h"
+#include "patch_text.h"
+#include "player.h"
+#include "smf.h"
+#include "trace.h"
+#include "wav_writer.h"
+
+DEFINE_string(patch, "", "Patch to play, in the text format of patch_text.h");
+DEFINE_string(bank, "",
+              "Patch bank for the song's program changes, from modfm_bank");
+DEFINE_int32(program, 0, "Bank program to start the song on");
+DEFINE_string(input, "", "Standard MIDI File to render");
+DEFINE_string(output, "out.wav", "32-bit float WAV file to write");
+DEFINE_int32(sample_rate, 44100, "Output sample rate");
+DEFINE_int32(voices, 8, "Polyphony of each player");
+DEFINE_int32(threads, 0, "Render threads; 0 means one per core");
+DEFINE_string(quality, "reference",
+              "Oscillator math quality: reference, polynomial or table");
+DEFINE_int32(oversampling, 4,
+             "Highest oversampling factor for generators that would alias: "
+             "1, 2 or 4");
+DEFINE_bool(clamp_index, false,
+            "Clamp modulation indexes to keep sidebands below Nyquist");
+DEFINE_string(trace_file, "",
+              "Write audio thread trace events here instead of the log");
+
+namespace {
+
+constexpr size_t kFramesPerBuffer = 4096;
+// Allowed on top of the longest release before a gap counts as silent.
+constexpr double kTailSeconds = 0.1;
+
+// A stretch of the song that starts and ends with every voice silent.
+struct Segment {
+  uint64_t start_frame;
+  uint64_t end_frame;
+  // Events [first_event, end_event) fall inside the segment.
+  size_t first_event;
+  size_t end_event;
+  // Controller values and bank program when the segment starts. The
+  // program is -1 without a bank.
+  std::array<uint8_t, 128> controllers;
+  int program;
+};
+
+// Adds note offs at the end of the song for notes never released.
+void ReleaseHeldNotes(std::vector<SMFEvent> *events) {
+  std::array<int, 128> held{};
+  for (const auto &e : *events) {
+    if (e.type == SMFEvent::Type::kNoteOn) held[e.data1]++;
+    if (e.type == SMFEvent::Type::kNoteOff && held[e.data1] > 0)
+      held[e.data1]--;
+  }
+  const double end = events->empty() ? 0.0 : events->back().time;
+  for (int note = 0; note < 128; note++) {
+    for (int i = 0; i < held[note]; i++)
+      events->push_back({end, SMFEvent::Type::kNoteOff, uint8_t(note), 0});
+  }
+}
+
+std::vector<Segment> Split(const std::vector<SMFEvent> &events,
+                           const std::vector<uint64_t> &frames,
+                           uint64_t tail_frames, int program) {
+  std::vector<Segment> segments;
+  Segment current{0, 0, 0, 0, {}, program};
+  std::array<uint8_t, 128> controllers{};
+  std::array<int, 128> held_notes{};
+  int held = 0;
+  bool played = false;
+  // Every voice of the current segment is done from here on.
+  uint64_t silent_from = 0;
+  for (size_t i = 0; i < events.size(); i++) {
+    const auto &e = events[i];
+    if (played && held == 0 && frames[i] >= silent_from) {
+      current.end_frame = silent_from;
+      current.end_event = i;
+      segments.push_back(current);
+      current = {silent_from, 0, i, 0, controllers, program};
+      played = false;
+    }
+    switch (e.type) {
+      case SMFEvent::Type::kNoteOn:
+        held_notes[e.data1]++;
+        held++;
+        played = true;
+        break;
+      case SMFEvent::Type::kNoteOff:
+        if (held_notes[e.data1] > 0) {
+          held_notes[e.data1]--;
+          held--;
+        }
+        if (held == 0) silent_from = frames[i] + tail_frames;
+        break;
+      case SMFEvent::Type::kControlChange:
+        controllers[e.data1] = e.data2;
+        break;
+      case SMFEvent::Type::kProgramChange:
+        if (program >= 0) program = e.data1;
+        break;
+    }
+  }
+  current.end_frame =
+      std::max(silent_from, frames.empty() ? 0 : frames.back() + 1);
+  current.end_event = events.size();
+  if (current.end_frame > current.start_frame) segments.push_back(current);
+  return segments;
+}
+
+void RenderSegment(const Segment &segment, const std::vector<SMFEvent> &events,
+                   const std::vector<uint64_t> &frames, Player *player,
+                   WavWriter *writer) {
+  std::vector<float> buffer(kFramesPerBuffer);
+  // Players are reused between segments. Starting each from scratch keeps
+  // the output the same however segments are spread over threads.
+  player->Reset();
+  for (int cc = 0; cc < 128; cc++) {
+    if (segment.controllers[cc])
+      player->ControlChange(0, cc, segment.controllers[cc]);
+  }
+  if (segment.program >= 0) player->ProgramChange(0, segment.program);
+
+  uint64_t frame = segment.start_frame;
+  size_t i = segment.first_event;
+  while (frame < segment.end_frame) {
+    // Queued events apply at the start of the next Perform(), so stopping
+    // each render at an event frame places the event exactly.
+    while (i < segment.end_event && frames[i] <= frame) {
+      const auto &e = events[i++];
+      switch (e.type) {
+        case SMFEvent::Type::kNoteOn:
+          player->NoteOn(0, e.data2, e.data1);
+          break;
+        case SMFEvent::Type::kNoteOff:
+          player->NoteOff(0, e.data1);
+          break;
+        case SMFEvent::Type::kControlChange:
+          player->ControlChange(0, e.data1, e.data2);
+          break;
+        case SMFEvent::Type::kProgramChange:
+          player->ProgramChange(0, e.data1);
+          break;
+      }
+    }
+    uint64_t stop = std::min(segment.end_frame, frame + kFramesPerBuffer);
+    if (i < segment.end_event) stop = std::min(stop, frames[i]);
+    size_t length = stop - frame;
+    player->Perform(nullptr, buffer.data(), length);
+    auto status = writer->Write(frame, buffer.data(), length);
+    CHECK(status.ok()) << status;
+    frame = stop;
+  }
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  FLAGS_logtostderr = true;
+  google::InitGoogleLogging(argv[0]);
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+  CHECK(!FLAGS_patch.empty() || !FLAGS_bank.empty())
+      << "--patch or --bank is required";
+  CHECK(!FLAGS_input.empty()) << "--input is required";
+  CHECK(FLAGS_sample_rate > 0)
+      << "Unsupported sample rate: " << FLAGS_sample_rate;
+
+  const std::unordered_map<std::string, Oscillator::Quality> qualities{
+      {"reference", Oscillator::Quality::kReference},
+      {"polynomial", Oscillator::Quality::kPolynomial},
+      {"table", Oscillator::Quality::kTable}};
+  auto quality = qualities.find(FLAGS_quality);
+  CHECK(quality != qualities.end()) << "Unknown quality: " << FLAGS_quality;
+
+  TraceDrain trace_drain(FLAGS_trace_file);
+  trace_drain.Start();
+
+  Patch patch;
+  absl::Status status;
+  if (!FLAGS_patch.empty()) {
+    status = LoadPatchText(FLAGS_patch, &patch);
+    CHECK(status.ok()) << status;
+  }
+  // Voices are silent once their longest amplitude release has run.
+  double release = 0.0;
+  for (const auto *g : patch.generators()) {
+    g->WithLock([&](const GeneratorPatch::Osc &,
+                    const GeneratorPatch::Envelope &a_env,
+                    const GeneratorPatch::Envelope &) {
+      release = std::max<double>(release, a_env.R_R);
+    });
+  }
+  std::unique_ptr<PatchBank> bank;
+  if (!FLAGS_bank.empty()) {
+    auto opened = PatchBank::Open(FLAGS_bank);
+    CHECK(opened.ok()) << opened.status();
+    bank = *std::move(opened);
+    CHECK(FLAGS_program >= 0 && FLAGS_program < 128)
+        << "Unsupported program: " << FLAGS_program;
+    // Any program could come up.
+    for (int p = 0; p < bank->num_programs(); p++) {
+      for (const auto &g : bank->generators(p))
+        release = std::max<double>(release, g.a_env.R_R);
+    }
+  }
+
+  auto smf = ReadSMF(FLAGS_input);
+  CHECK(smf.ok()) << smf.status();
+  std::vector<SMFEvent> events = *std::move(smf);
+  ReleaseHeldNotes(&events);
+  std::vector<uint64_t> frames;
+  frames.reserve(events.size());
+  for (const auto &e : events)
+    frames.push_back(std::llround(e.time * FLAGS_sample_rate));
+
+  const auto tail_frames = static_cast<uint64_t>(
+      std::ceil((release + kTailSeconds) * FLAGS_sample_rate));
+  const std::vector<Segment> segments =
+      Split(events, frames, tail_frames, bank ? FLAGS_program : -1);
+  const uint64_t total_frames =
+      segments.empty() ? 0 : segments.back().end_frame;
+
+  WavWriter writer;
+  status = writer.Open(FLAGS_output, FLAGS_sample_rate, total_frames);
+  CHECK(status.ok()) << status;
+
+  // Whole segments per core where there are enough of them, otherwise every
+  // core on each block of the one segment.
+  int threads = FLAGS_threads > 0
+                    ? FLAGS_threads
+                    : std::max(1u, std::thread::hardware_concurrency());
+  const int num_players = std::clamp<int>(segments.size(), 1, threads);
+  const int threads_per_player = num_players == 1 ? threads : 1;
+  // Every player reads its patch's snapshot from its own thread, and a patch
+  // has only the one reader, so each player gets a patch of its own.
+  std::vector<std::unique_ptr<Patch>> patches;
+  std::vector<std::unique_ptr<Player>> players;
+  for (int i = 0; i < num_players; i++) {
+    Patch *player_patch = &patch;
+    if (i > 0) {
+      patches.push_back(std::make_unique<Patch>());
+      player_patch = patches.back().get();
+      if (!FLAGS_patch.empty()) {
+        status = LoadPatchText(FLAGS_patch, player_patch);
+        CHECK(status.ok()) << status;
+      }
+    }
+    players.push_back(std::make_unique<Player>(
+        player_patch, FLAGS_voices, FLAGS_sample_rate, kFramesPerBuffer,
+        threads_per_player));
+    players.back()->SetQuality(quality->second);
+    players.back()->SetMaxOversampling(FLAGS_oversampling);
+    players.back()->SetIndexClamping(FLAGS_clamp_index);
+    players.back()->SetDeadline(0);
+    players.back()->SetPatchBank(bank.get());
+  }
+
+  LOG(INFO) << absl::StrFormat(
+      "Rendering %d events in %d segments with %d players", events.size(),
+      segments.size(), num_players);
+  const auto start = std::chrono::steady_clock::now();
+  std::atomic<size_t> next_segment{0};
+  auto render = [&](Player *player) {
+    for (size_t s; (s = next_segment++) < segments.size();)
+      RenderSegment(segments[s], events, frames, player, &writer);
+  };
+  std::vector<std::thread> workers;
+  for (int i = 1; i < num_players; i++)
+    workers.emplace_back(render, players[i].get());
+  render(players[0].get());
+  for (auto &w : workers) w.join();
+  const std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+
+  status = writer.Close();
+  CHECK(status.ok()) << status;
+
+  const double seconds = static_cast<double>(total_frames) / FLAGS_sample_rate;
+  LOG(INFO) << absl::StrFormat(
+      "Wrote %.1f s of audio to %s in %.2f s, %.1fx real time", seconds,
+      FLAGS_output, elapsed.count(), seconds / elapsed.count());
+  return 0;
+}
@@ -0,0 +1,236 @@
+#include "smf.h"
+
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+
+#include "absl/strings/str_format.h"
+
+namespace {
+
+constexpr uint32_t kDefaultTempo = 500000;  // microseconds per quarter, 120bpm
+
+// A channel event before the tempo map is applied.
+struct TickEvent {
+  uint64_t tick;
+  SMFEvent::Type type;
+  uint8_t data1;
+  uint8_t data2;
+};
+
+struct TempoChange {
+  uint64_t tick;
+  uint32_t tempo;
+};
+
+class Reader {
+ public:
+  Reader(const std::vector<uint8_t> &data, size_t pos, size_t end)
+      : data_(data), pos_(pos), end_(end) {}
+
+  bool done() const { return pos_ >= end_; }
+  size_t pos() const { return pos_; }
+
+  bool Byte(uint8_t *value) {
+    if (pos_ >= end_) return false;
+    *value = data_[pos_++];
+    return true;
+  }
+
+  bool Fixed(int bytes, uint32_t *value) {
+    if (end_ - pos_ < bytes) return false;
+    *value = 0;
+    for (int i = 0; i < bytes; i++) *value = (*value << 8) | data_[pos_++];
+    return true;
+  }
+
+  bool VariableLength(uint32_t *value) {
+    *value = 0;
+    for (int i = 0; i < 4; i++) {
+      uint8_t byte;
+      if (!Byte(&byte)) return false;
+      *value = (*value << 7) | (byte & 0x7f);
+      if (!(byte & 0x80)) return true;
+    }
+    return false;
+  }
+
+  bool Skip(size_t bytes) {
+    if (end_ - pos_ < bytes) return false;
+    pos_ += bytes;
+    return true;
+  }
+
+ private:
+  const std::vector<uint8_t> &data_;
+  size_t pos_;
+  const size_t end_;
+};
+
+absl::Status Truncated(int track) {
+  return absl::Status(absl::StatusCode::kInvalidArgument,
+                      absl::StrFormat("Track %d is truncated", track));
+}
+
+absl::Status ReadTrack(Reader reader, int track,
+                       std::vector<TickEvent> *events,
+                       std::vector<TempoChange> *tempos) {
+  uint64_t tick = 0;
+  uint8_t running_status = 0;
+  while (!reader.done()) {
+    uint32_t delta;
+    uint8_t status;
+    if (!reader.VariableLength(&delta) || !reader.Byte(&status))
+      return Truncated(track);
+    tick += delta;
+
+    if (status == 0xff) {
+      uint8_t type;
+      uint32_t length;
+      if (!reader.Byte(&type) || !reader.VariableLength(&length))
+        return Truncated(track);
+      // Meta and sysex events cancel running status.
+      running_status = 0;
+      if (type == 0x2f) break;  // end of track
+      if (type == 0x51 && length == 3) {
+        uint32_t tempo;
+        if (!reader.Fixed(3, &tempo)) return Truncated(track);
+        tempos->push_back({tick, tempo});
+      } else if (!reader.Skip(length)) {
+        return Truncated(track);
+      }
+      continue;
+    }
+    if (status == 0xf0 || status == 0xf7) {
+      running_status = 0;
+      uint32_t length;
+      if (!reader.VariableLength(&length) || !reader.Skip(length))
+        return Truncated(track);
+      continue;
+    }
+
+    uint8_t data1, data2 = 0;
+    if (status & 0x80) {
+      running_status = status;
+      if (!reader.Byte(&data1)) return Truncated(track);
+    } else {
+      if (!running_status)
+        return absl::Status(
+            absl::StatusCode::kInvalidArgument,
+            absl::StrFormat("Data byte without status in track %d", track));
+      data1 = status;
+      status = running_status;
+    }
+    const uint8_t kind = status & 0xf0;
+    // Program change and channel pressure carry one data byte.
+    if (kind != 0xc0 && kind != 0xd0 && !reader.Byte(&data2))
+      return Truncated(track);
+    data1 &= 0x7f;
+    data2 &= 0x7f;
+
+    if (kind == 0x90 && data2 > 0) {
+      events->push_back({tick, SMFEvent::Type::kNoteOn, data1, data2});
+    } else if (kind == 0x80 || kind == 0x90) {
+      events->push_back({tick, SMFEvent::Type::kNoteOff, data1, 0});
+    } else if (kind == 0xb0) {
+      events->push_back({tick, SMFEvent::Type::kControlChange, data1, data2});
+    } else if (kind == 0xc0) {
+      events->push_back({tick, SMFEvent::Type::kProgramChange, data1, 0});
+    }
+  }
+  return absl::OkStatus();
+}
+
+}  // namespace
+
+absl::StatusOr<std::vector<SMFEvent>> ReadSMF(const std::string &path) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file) {
+    return absl::Status(absl::StatusCode::kNotFound,
+                        absl::StrFormat("Unable to open %s", path));
+  }
+  const std::vector<uint8_t> data((std::istreambuf_iterator<char>(file)),
+                                  std::istreambuf_iterator<char>());
+
+  Reader reader(data, 0, data.size());
+  uint32_t magic, header_length, format, num_tracks, division;
+  if (!reader.Fixed(4, &magic) || magic != 0x4d546864 /* MThd */ ||
+      !reader.Fixed(4, &header_length) || header_length < 6 ||
+      !reader.Fixed(2, &format) || !reader.Fixed(2, &num_tracks) ||
+      !reader.Fixed(2, &division) || !reader.Skip(header_length - 6)) {
+    return absl::Status(
+        absl::StatusCode::kInvalidArgument,
+        absl::StrFormat("%s is not a Standard MIDI File", path));
+  }
+  if (format > 1) {
+    return absl::Status(
+        absl::StatusCode::kUnimplemented,
+        absl::StrFormat("SMF format %d is not supported", format));
+  }
+  if (division == 0) {
+    return absl::Status(absl::StatusCode::kInvalidArgument,
+                        "SMF division is zero");
+  }
+  if ((division & 0x8000) && (division & 0xff) == 0) {
+    return absl::Status(absl::StatusCode::kInvalidArgument,
+                        "SMF SMPTE division has zero ticks per frame");
+  }
+
+  std::vector<TickEvent> events;
+  std::vector<TempoChange> tempos;
+  for (int track = 0; track < num_tracks && !reader.done();) {
+    uint32_t chunk_type, length;
+    if (!reader.Fixed(4, &chunk_type) || !reader.Fixed(4, &length) ||
+        data.size() - reader.pos() < length) {
+      return Truncated(track);
+    }
+    // Unknown chunk types are to be skipped.
+    if (chunk_type == 0x4d54726b /* MTrk */) {
+      auto status = ReadTrack(Reader(data, reader.pos(), reader.pos() + length),
+                              track, &events, &tempos);
+      if (!status.ok()) return status;
+      track++;
+    }
+    reader.Skip(length);
+  }
+
+  // Events at the same tick keep their file order, tracks in order.
+  std::stable_sort(events.begin(), events.end(),
+                   [](const TickEvent &a, const TickEvent &b) {
+                     return a.tick < b.tick;
+                   });
+  std::stable_sort(tempos.begin(), tempos.end(),
+                   [](const TempoChange &a, const TempoChange &b) {
+                     return a.tick < b.tick;
+                   });
+
+  std::vector<SMFEvent> result;
+  result.reserve(events.size());
+  if (division & 0x8000) {
+    // SMPTE: frames per second in the high byte, as a negative number, and
+    // ticks per frame in the low byte. 29 means 29.97 drop frame.
+    int fps = -static_cast<int8_t>(division >> 8);
+    double frame_rate = fps == 29 ? 29.97 : fps;
+    double ticks_per_second = frame_rate * (division & 0xff);
+    for (const auto &e : events)
+      result.push_back({e.tick / ticks_per_second, e.type, e.data1, e.data2});
+    return result;
+  }
+
+  // Metrical: walk the tempo map alongside the events.
+  size_t next_tempo = 0;
+  uint64_t segment_tick = 0;
+  double segment_time = 0.0;
+  double seconds_per_tick = kDefaultTempo * 1e-6 / division;
+  for (const auto &e : events) {
+    while (next_tempo < tempos.size() && tempos[next_tempo].tick <= e.tick) {
+      const auto &change = tempos[next_tempo++];
+      segment_time += (change.tick - segment_tick) * seconds_per_tick;
+      segment_tick = change.tick;
+      seconds_per_tick = change.tempo * 1e-6 / division;
+    }
+    double time = segment_time + (e.tick - segment_tick) * seconds_per_tick;
+    result.push_back({time, e.type, e.data1, e.data2});
+  }
+  return result;
+}
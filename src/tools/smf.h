@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "absl/status/statusor.h"
+
+// The channel events of a Standard MIDI File the player understands, merged
+// across tracks and channels and timed in seconds through the tempo map.
+struct SMFEvent {
+  enum class Type : uint8_t {
+    kNoteOn,
+    kNoteOff,
+    kControlChange,
+    kProgramChange
+  };
+
+  double time;  // seconds from the start of the file
+  Type type;
+  // Note number, controller number or program number.
+  uint8_t data1;
+  // Velocity or controller value.
+  uint8_t data2;
+};
+
+// Reads format 0 and 1 files, with either metrical or SMPTE timing. Events
+// come back in time order; note ons with zero velocity are note offs.
+absl::StatusOr<std::vector<SMFEvent>> ReadSMF(const std::string &path);
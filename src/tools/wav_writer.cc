@@ -0,0 +1,99 @@
+#include "wav_writer.h"
+
+#include <cstring>
+#include <limits>
+
+#include "absl/strings/str_format.h"
+
+namespace {
+
+constexpr uint32_t kHeaderSize = 44;
+constexpr uint16_t kFormatIEEEFloat = 3;
+
+void Put16(uint8_t *p, uint16_t value) {
+  p[0] = value & 0xff;
+  p[1] = value >> 8;
+}
+
+void Put32(uint8_t *p, uint32_t value) {
+  for (int i = 0; i < 4; i++) p[i] = (value >> (8 * i)) & 0xff;
+}
+
+}  // namespace
+
+WavWriter::~WavWriter() {
+  if (file_) std::fclose(file_);
+}
+
+absl::Status WavWriter::Open(const std::string &path, int sample_rate,
+                             uint64_t num_frames) {
+  const uint64_t data_size = num_frames * sizeof(float);
+  if (data_size + kHeaderSize - 8 > std::numeric_limits<uint32_t>::max()) {
+    return absl::Status(absl::StatusCode::kOutOfRange,
+                        "Render is too long for a WAV file");
+  }
+  file_ = std::fopen(path.c_str(), "wb");
+  if (!file_) {
+    return absl::Status(absl::StatusCode::kPermissionDenied,
+                        absl::StrFormat("Unable to create %s", path));
+  }
+  num_frames_ = num_frames;
+
+  uint8_t header[kHeaderSize];
+  std::memcpy(header, "RIFF", 4);
+  Put32(header + 4, kHeaderSize - 8 + data_size);
+  std::memcpy(header + 8, "WAVEfmt ", 8);
+  Put32(header + 16, 16);
+  Put16(header + 20, kFormatIEEEFloat);
+  Put16(header + 22, 1);  // channels
+  Put32(header + 24, sample_rate);
+  Put32(header + 28, sample_rate * sizeof(float));
+  Put16(header + 32, sizeof(float));  // block align
+  Put16(header + 34, 32);             // bits per sample
+  std::memcpy(header + 36, "data", 4);
+  Put32(header + 40, data_size);
+  if (std::fwrite(header, 1, kHeaderSize, file_) != kHeaderSize) {
+    return absl::Status(absl::StatusCode::kDataLoss,
+                        absl::StrFormat("Unable to write to %s", path));
+  }
+  return absl::OkStatus();
+}
+
+absl::Status WavWriter::Write(uint64_t start, const float *samples,
+                              size_t frames) {
+  static_assert(std::numeric_limits<float>::is_iec559);
+  if (start + frames > num_frames_) {
+    return absl::Status(absl::StatusCode::kOutOfRange,
+                        "Write past the end of the file");
+  }
+  // Samples go out in host order; every platform we build on is little
+  // endian like WAV.
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (std::fseek(file_, kHeaderSize + start * sizeof(float), SEEK_SET) != 0 ||
+      std::fwrite(samples, sizeof(float), frames, file_) != frames) {
+    return absl::Status(absl::StatusCode::kDataLoss, "Unable to write samples");
+  }
+  return absl::OkStatus();
+}
+
+absl::Status WavWriter::Close() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  // Frames nobody wrote read back as silence, but only if the file is
+  // actually that long.
+  if (num_frames_ && std::fseek(file_, 0, SEEK_END) == 0) {
+    long end = std::ftell(file_);
+    long expected = kHeaderSize + num_frames_ * sizeof(float);
+    if (end < expected) {
+      const float zero = 0.0f;
+      std::fseek(file_, expected - sizeof(float), SEEK_SET);
+      std::fwrite(&zero, sizeof(float), 1, file_);
+    }
+  }
+  int err = std::fclose(file_);
+  file_ = nullptr;
+  if (err) {
+    return absl::Status(absl::StatusCode::kDataLoss,
+                        "Unable to finish writing the WAV file");
+  }
+  return absl::OkStatus();
+}
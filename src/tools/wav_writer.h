@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+
+#include "absl/status/status.h"
+
+// Mono 32-bit float WAV file of a length known up front. The header is
+// written on Open(), so frames can be written in any order, from any thread,
+// as soon as they are rendered.
+class WavWriter {
+ public:
+  WavWriter() = default;
+  ~WavWriter();
+
+  WavWriter(const WavWriter &) = delete;
+  WavWriter &operator=(const WavWriter &) = delete;
+
+  absl::Status Open(const std::string &path, int sample_rate,
+                    uint64_t num_frames);
+
+  // Writes `frames` samples starting at frame `start`.
+  absl::Status Write(uint64_t start, const float *samples, size_t frames);
+
+  absl::Status Close();
+
+ private:
+  std::mutex mutex_;
+  std::FILE *file_ = nullptr;
+  uint64_t num_frames_ = 0;
+};
@@ -0,0 +1,155 @@
+#include "trace.h"
+
+#include <glog/logging.h>
+
+#include <chrono>
+#include <sstream>
+
+namespace {
+
+constexpr auto kDrainInterval = std::chrono::milliseconds(50);
+
+constexpr const char *kStageLabels[]{"OFF", "ATTACK", "DECAY", "SUSTAIN",
+                                     "RELEASE"};
+
+}  // namespace
+
+thread_local TraceRing::Context TraceRing::context_{};
+
+TraceRing &TraceRing::Get() {
+  static TraceRing ring;
+  return ring;
+}
+
+TraceRing::TraceRing() {
+  for (size_t i = 0; i < kCapacity; i++) {
+    slots_[i].sequence.store(i, std::memory_order_relaxed);
+  }
+}
+
+void TraceRing::Record(TraceEvent event, uint8_t arg, int32_t index,
+                       float value) {
+  uint64_t pos = head_.load(std::memory_order_relaxed);
+  Slot *slot;
+  for (;;) {
+    slot = &slots_[pos % kCapacity];
+    uint64_t sequence = slot->sequence.load(std::memory_order_acquire);
+    auto diff = static_cast<int64_t>(sequence - pos);
+    if (diff == 0) {
+      if (head_.compare_exchange_weak(pos, pos + 1,
+                                      std::memory_order_relaxed))
+        break;
+    } else if (diff < 0) {
+      dropped_.fetch_add(1, std::memory_order_relaxed);
+      return;
+    } else {
+      pos = head_.load(std::memory_order_relaxed);
+    }
+  }
+  slot->record = {context_.frame, context_.offset, context_.player, event,
+                  arg, index, value};
+  slot->sequence.store(pos + 1, std::memory_order_release);
+}
+
+bool TraceRing::Pop(TraceRecord *record) {
+  uint64_t pos = tail_.load(std::memory_order_relaxed);
+  Slot &slot = slots_[pos % kCapacity];
+  if (slot.sequence.load(std::memory_order_acquire) != pos + 1) return false;
+  *record = slot.record;
+  slot.sequence.store(pos + kCapacity, std::memory_order_release);
+  tail_.store(pos + 1, std::memory_order_relaxed);
+  return true;
+}
+
+std::string TraceRing::Describe(const TraceRecord &record) {
+  std::ostringstream out;
+  if (record.player) out << "player " << record.player << " ";
+  out << "frame " << record.frame;
+  if (record.offset) out << "+" << record.offset;
+  out << ": ";
+  switch (record.event) {
+    case TraceEvent::kEnvelopeStage:
+      out << "envelope "
+          << (record.arg < std::size(kStageLabels) ? kStageLabels[record.arg]
+                                                   : "?")
+          << " segment " << record.index << " level " << record.value;
+      break;
+    case TraceEvent::kVoiceSteal:
+      out << "note " << int(record.arg) << " stole voice " << record.index
+          << " from note " << record.value;
+      break;
+    case TraceEvent::kNoVoice:
+      out << "no voice to steal for note " << int(record.arg);
+      break;
+    case TraceEvent::kUnmatchedNoteOff:
+      out << "unable to find voice for note off " << int(record.arg);
+      break;
+    case TraceEvent::kStreamStatus:
+      out << "stream status " << std::hex << record.index;
+      break;
+    case TraceEvent::kEventQueueFull:
+      out << "event queue full, dropped note " << int(record.arg);
+      break;
+    case TraceEvent::kRenderDeadline:
+      out << "render deadline passed, skipped " << record.index
+          << " generators";
+      break;
+    case TraceEvent::kOverrun:
+      out << "overrun, load " << record.value << " with " << record.index
+          << " voices" << (record.arg ? " after a patch edit" : "");
+      break;
+    case TraceEvent::kProgramChange:
+      out << "program change " << int(record.arg) << " to bank program "
+          << int64_t(record.value);
+      if (record.index < 0)
+        out << ", not in the patch bank";
+      else
+        out << ", " << record.index << " generators";
+      break;
+  }
+  return out.str();
+}
+
+TraceDrain::TraceDrain(const std::string &path) {
+  if (!path.empty()) {
+    file_.open(path);
+    CHECK(file_.is_open()) << "Unable to open trace file: " << path;
+  }
+}
+
+TraceDrain::~TraceDrain() { Stop(); }
+
+void TraceDrain::Start() {
+  if (running_) return;
+  running_ = true;
+  drain_thread_ = std::thread([this] {
+    while (running_) {
+      Drain();
+      std::this_thread::sleep_for(kDrainInterval);
+    }
+    Drain();
+  });
+}
+
+void TraceDrain::Stop() {
+  running_ = false;
+  if (drain_thread_.joinable()) drain_thread_.join();
+}
+
+void TraceDrain::Drain() {
+  auto &ring = TraceRing::Get();
+  TraceRecord record;
+  while (ring.Pop(&record)) {
+    if (file_.is_open())
+      file_ << TraceRing::Describe(record) << "\n";
+    else
+      LOG(INFO) << TraceRing::Describe(record);
+  }
+  uint64_t dropped = ring.dropped();
+  if (dropped != reported_dropped_) {
+    LOG(WARNING) << "Trace ring full, dropped "
+                 << dropped - reported_dropped_ << " records";
+    reported_dropped_ = dropped;
+  }
+  if (file_.is_open()) file_.flush();
+}
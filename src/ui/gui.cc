@@ -13,11 +13,13 @@
 #include <nanogui/tabwidget.h>
 #include <nanogui/vscrollpanel.h>
 
+#include <chrono>
 #include <functional>
 #include <sigslot/signal.hpp>
 
 #include "midi.h"
 #include "patch.h"
+#include "player.h"
 #include "ui/device_selector.h"
 #include "ui/drawbars.h"
 #include "ui/patch_editor.h"
@@ -26,8 +28,10 @@ using namespace nanogui;
 
 class PatchScreen : public nanogui::Screen {
  public:
-  PatchScreen(Patch *patch, MIDIReceiver *midi_receiver)
-      : Screen(nanogui::Vector2i{640, 480}, "Patch"), patch_(patch) {
+  PatchScreen(Patch *patch, MIDIReceiver *midi_receiver, const Player *player)
+      : Screen(nanogui::Vector2i{640, 480}, "Patch"),
+        patch_(patch),
+        player_(player) {
     inc_ref();
 
     Widget *vertical_stack = new Widget(this);
@@ -40,6 +44,9 @@ class PatchScreen : public nanogui::Screen {
 
     new Label(top_panel, "Input device");
     new MIDIDeviceSelector(top_panel, midi_receiver);
+    load_label_ = new Label(top_panel, "");
+    // Wide enough for any reading, so updates don't move the other widgets.
+    load_label_->set_fixed_width(300);
 
     auto *tabs_widget = new TabWidget(vertical_stack);
 
@@ -128,8 +135,26 @@ class PatchScreen : public nanogui::Screen {
             })");
   }
 
+  void draw(NVGcontext *ctx) override {
+    // The main loop redraws every frame; update the reading a few times a
+    // second so it can be read.
+    auto now = std::chrono::steady_clock::now();
+    if (now - last_load_update_ > std::chrono::milliseconds(250)) {
+      last_load_update_ = now;
+      RenderStats::Snapshot stats = player_->stats().Read();
+      load_label_->set_caption(absl::StrFormat(
+          "DSP %.0f%% (peak %.0f%%), %d overruns, %d underruns",
+          100 * stats.average_load, 100 * stats.peak_load, stats.overruns,
+          stats.underruns));
+    }
+    Screen::draw(ctx);
+  }
+
  private:
   Patch *patch_;
+  const Player *player_;
+  Label *load_label_;
+  std::chrono::steady_clock::time_point last_load_update_;
   std::array<GeneratorModel, kNumBars> bars;
   GeneratorPatchEditor *generator_editor_ = nullptr;
   std::unordered_map<int, GeneratorPatch *> bars_to_patches_;
@@ -137,8 +162,8 @@ class PatchScreen : public nanogui::Screen {
   nanogui::Shader *shader_;
 };
 
-GUI::GUI(Patch *patch, MIDIReceiver *midi_receiver)
-    : patch_(patch), midi_receiver_(midi_receiver) {}
+GUI::GUI(Patch *patch, MIDIReceiver *midi_receiver, const Player *player)
+    : patch_(patch), midi_receiver_(midi_receiver), player_(player) {}
 
 void GUI::Start() {
   StartUI();
@@ -160,7 +185,7 @@ void GUI::StartUI() {
     nanogui::init();
 
     nanogui::ref<PatchScreen> patch_screen =
-        new PatchScreen(patch_, midi_receiver_);
+        new PatchScreen(patch_, midi_receiver_, player_);
     patch_screen->draw_all();
     patch_screen->set_visible(true);
     nanogui::mainloop(1 / 60.f * 1000);
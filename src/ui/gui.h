@@ -5,9 +5,11 @@
 
 class Patch;
 class MIDIReceiver;
+class Player;
 class GUI {
  public:
-  GUI(Patch *patch, MIDIReceiver *midi_receiver);
+  // `player` is only read from, for its render stats.
+  GUI(Patch *patch, MIDIReceiver *midi_receiver, const Player *player);
   ~GUI();
   void Start();
   void Stop();
@@ -18,4 +20,5 @@ class GUI {
 
   Patch *patch_;
   MIDIReceiver *midi_receiver_;
+  const Player *player_;
 };
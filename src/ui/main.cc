@@ -11,17 +11,28 @@
 
 #include "midi.h"
 #include "player.h"
+#include "trace.h"
 #include "ui/gui.h"
 
 DEFINE_int32(midi, 0, "MIDI device to use for input. If not set, use default.");
 DEFINE_string(device, "pulse", "Name of audio output device to use");
+DEFINE_string(quality, "polynomial",
+              "Oscillator math quality: reference, polynomial or table");
+DEFINE_string(trace_file, "",
+              "Write audio thread trace events here instead of the log");
+DEFINE_string(bank, "",
+              "Patch bank for MIDI program changes to select from, as written "
+              "by modfm_bank");
 
 namespace {
 constexpr int kSampleFrequency = 44100;
+constexpr int kFramesPerBuffer = 4096;
 
 std::unique_ptr<GUI> kGUI;
 std::unique_ptr<Patch> kPatch;
 std::unique_ptr<MIDIReceiver> kMIDIReceiver;
+// Outlives the player reading from it.
+std::unique_ptr<PatchBank> kBank;
 std::unique_ptr<Player> kPlayer;
 
 void SignalHandler(int signal) {
@@ -41,9 +52,17 @@ int pa_output_callback(const void *in_buffer, void *out_buffer,
                        PaStreamCallbackFlags status_flags, void *user_data) {
   auto *player = (Player *)user_data;
   if (status_flags != 0) {
-    LOG(ERROR) << "Status: " << status_flags;
+    MODFM_TRACE(TraceEvent::kStreamStatus, 0, status_flags);
+    if (status_flags & paOutputUnderflow) player->ReportUnderrun();
   }
-  player->Perform(in_buffer, out_buffer, frames_per_buffer);
+  // Move the buffer's DAC time onto the PortTime clock that MIDI timestamps
+  // are on. Some host APIs don't fill in the stream times.
+  double block_time_ms = Pt_Time();
+  if (time_info->currentTime > 0 && time_info->outputBufferDacTime > 0) {
+    block_time_ms +=
+        (time_info->outputBufferDacTime - time_info->currentTime) * 1000.0;
+  }
+  player->Perform(in_buffer, out_buffer, frames_per_buffer, block_time_ms);
   return paContinue;
 }
 
@@ -80,13 +99,37 @@ int main(int argc, char *argv[]) {
       Pa_GetDeviceInfo(audio_params.device)->defaultLowOutputLatency;
   audio_params.hostApiSpecificStreamInfo = nullptr;
 
+  TraceDrain trace_drain(FLAGS_trace_file);
+  trace_drain.Start();
+
   kPatch = std::make_unique<Patch>();
-  kPlayer = std::make_unique<Player>(kPatch.get(), 8, kSampleFrequency);
+  kPlayer = std::make_unique<Player>(kPatch.get(), 8, kSampleFrequency,
+                                     kFramesPerBuffer);
+  const std::unordered_map<std::string, Oscillator::Quality> qualities{
+      {"reference", Oscillator::Quality::kReference},
+      {"polynomial", Oscillator::Quality::kPolynomial},
+      {"table", Oscillator::Quality::kTable}};
+  auto quality = qualities.find(FLAGS_quality);
+  CHECK(quality != qualities.end()) << "Unknown quality: " << FLAGS_quality;
+  kPlayer->SetQuality(quality->second);
+  if (!FLAGS_bank.empty()) {
+    auto bank = PatchBank::Open(FLAGS_bank);
+    CHECK(bank.ok()) << bank.status();
+    kBank = *std::move(bank);
+    kPlayer->SetPatchBank(kBank.get());
+  }
+
+  // PortMidi stamps events with PortTime, which has to be running before a
+  // device is opened.
+  Pt_Start(1, nullptr, nullptr);
 
   PaStream *stream;
-  err = Pa_OpenStream(&stream, nullptr, &audio_params, kSampleFrequency, 4096,
-                      paClipOff, pa_output_callback, kPlayer.get());
+  err = Pa_OpenStream(&stream, nullptr, &audio_params, kSampleFrequency,
+                      kFramesPerBuffer, paClipOff, pa_output_callback,
+                      kPlayer.get());
   CHECK_EQ(err, paNoError) << "PortAudio error: " << Pa_GetErrorText(err);
+  kPlayer->SetEventLatency(Pa_GetStreamInfo(stream)->outputLatency * 1000.0 +
+                           1000.0 * kFramesPerBuffer / kSampleFrequency);
 
   // Set up the midi receiver and open the default device or what was passed in.
   kMIDIReceiver = std::make_unique<MIDIReceiver>();
@@ -97,21 +140,23 @@ int main(int argc, char *argv[]) {
     CHECK(kMIDIReceiver->OpenDefaultDevice().ok())
         << "Unable to open MIDI device";
 
-  // Wire in note on / off events to the player.
+  // Wire in note on / off and controller events to the player.
   kMIDIReceiver->NoteOffSignal.connect(&Player::NoteOff, kPlayer.get());
   kMIDIReceiver->NoteOnSignal.connect(&Player::NoteOn, kPlayer.get());
+  kMIDIReceiver->ControlChangeSignal.connect(&Player::ControlChange,
+                                             kPlayer.get());
+  kMIDIReceiver->ProgramChangeSignal.connect(&Player::ProgramChange,
+                                             kPlayer.get());
 
   err = Pa_StartStream(stream);
   CHECK_EQ(err, paNoError) << "PortAudio error: " << Pa_GetErrorText(err);
 
   LOG(INFO) << "Started PortAudio on device #" << audio_params.device;
 
-  /* start timer, ms accuracy */
-  Pt_Start(1, nullptr, nullptr);
-
   CHECK(kMIDIReceiver->Start().ok()) << "Unable to start MIDI device";
 
-  kGUI = std::make_unique<GUI>(kPatch.get(), kMIDIReceiver.get());
+  kGUI = std::make_unique<GUI>(kPatch.get(), kMIDIReceiver.get(),
+                               kPlayer.get());
   kGUI->Start();
 
   std::signal(SIGTERM, SignalHandler);
@@ -101,11 +101,17 @@ void MIDIReceiver::ProcessBuffer(const PmEvent *buffer, int length) {
       auto channel = status & 0xf;
       auto note = data1 & 0x7f;
       auto velocity = data2 & 0x7f;
-      NoteOnSignal(buffer[0].timestamp, velocity, note);
+      NoteOnSignal(buffer[i].timestamp, velocity, note);
     } else if (event_masked == 0x80) {
       auto channel = status & 0xf;
       auto note = data1 & 0x7f;
-      NoteOffSignal(note);
+      NoteOffSignal(buffer[i].timestamp, note);
+    } else if (event_masked == 0xb0) {
+      auto controller = data1 & 0x7f;
+      auto value = data2 & 0x7f;
+      ControlChangeSignal(buffer[i].timestamp, controller, value);
+    } else if (event_masked == 0xc0) {
+      ProgramChangeSignal(buffer[i].timestamp, data1 & 0x7f);
     }
   }
 }
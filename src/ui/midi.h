@@ -22,7 +22,10 @@ class MIDIReceiver {
 
   sigslot::signal<PmTimestamp, uint8_t /* note */, uint8_t /* velocity */>
       NoteOnSignal;
-  sigslot::signal<uint8_t> NoteOffSignal;
+  sigslot::signal<PmTimestamp, uint8_t /* note */> NoteOffSignal;
+  sigslot::signal<PmTimestamp, uint8_t /* controller */, uint8_t /* value */>
+      ControlChangeSignal;
+  sigslot::signal<PmTimestamp, uint8_t /* program */> ProgramChangeSignal;
 
  private:
   void ProcessBuffer(const PmEvent *buffer, int length);
@@ -0,0 +1,127 @@
+#include "wavetable.h"
+
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include <map>
+#include <mutex>
+#include <numbers>
+#include <tuple>
+
+namespace {
+
+constexpr double kTwoPi = 2.0 * std::numbers::pi;
+constexpr float kRatioTolerance = 1e-4f;
+// The waveform is analysed at twice the table size so that harmonics between
+// kMaxHarmonic and the table's Nyquist don't alias into the stored spectrum.
+constexpr size_t kAnalysisSize = Wavetable::kTableSize * 2;
+// Sidebands past roughly (R + S) * K + this many are negligible.
+constexpr int kSidebandMargin = 4;
+
+bool IsInteger(float v) {
+  return std::fabs(v - std::round(v)) < kRatioTolerance;
+}
+
+// In place iterative radix-2 FFT; x.size() must be a power of two.
+void FFT(std::vector<std::complex<double>> &x, bool inverse) {
+  const size_t n = x.size();
+  for (size_t i = 1, j = 0; i < n; i++) {
+    size_t bit = n >> 1;
+    for (; j & bit; bit >>= 1) j ^= bit;
+    j ^= bit;
+    if (i < j) std::swap(x[i], x[j]);
+  }
+  for (size_t len = 2; len <= n; len <<= 1) {
+    std::complex<double> w_len =
+        std::polar(1.0, (inverse ? kTwoPi : -kTwoPi) / len);
+    for (size_t i = 0; i < n; i += len) {
+      std::complex<double> w = 1.0;
+      for (size_t j = 0; j < len / 2; j++) {
+        std::complex<double> u = x[i + j];
+        std::complex<double> v = x[i + j + len / 2] * w;
+        x[i + j] = u + v;
+        x[i + j + len / 2] = u - v;
+        w *= w_len;
+      }
+    }
+  }
+}
+
+using Key = std::tuple<float, float, float, float, float>;
+
+std::mutex cache_mutex;
+std::map<Key, std::weak_ptr<const Wavetable>> cache;
+
+}  // namespace
+
+std::shared_ptr<const Wavetable> Wavetable::Get(const GeneratorPatch::Osc &osc,
+                                                float max_k) {
+  float modulator = osc.C * osc.M;
+  if (!IsInteger(osc.C) || !IsInteger(modulator) || osc.C < 0 ||
+      modulator < 0) {
+    return nullptr;
+  }
+  int sidebands =
+      static_cast<int>(std::ceil((osc.R + osc.S) * max_k)) + kSidebandMargin;
+  if (std::round(osc.C) + sidebands * std::round(modulator) > kMaxHarmonic) {
+    return nullptr;
+  }
+
+  Key key{std::round(osc.C), std::round(modulator), osc.R, osc.S, max_k};
+  std::lock_guard<std::mutex> cache_lock(cache_mutex);
+  auto it = cache.find(key);
+  if (it != cache.end()) {
+    if (auto table = it->second.lock()) return table;
+  }
+  // Drop entries whose tables have been released while we're here.
+  std::erase_if(cache,
+                [](const auto &entry) { return entry.second.expired(); });
+  auto table = std::make_shared<const Wavetable>(osc, max_k);
+  cache[key] = table;
+  return table;
+}
+
+Wavetable::Wavetable(const GeneratorPatch::Osc &osc, float max_k)
+    : max_k_(max_k),
+      k_scale_(max_k > 0 ? kKSteps / max_k : 0.0f),
+      samples_(kNumMipLevels * (kKSteps + 1) * (kTableSize + 1)) {
+  const double carrier = std::round(osc.C);
+  const double modulator = std::round(osc.C * osc.M);
+  std::vector<std::complex<double>> spectrum(kAnalysisSize);
+  std::vector<std::complex<double>> mip(kTableSize);
+  for (int k_step = 0; k_step <= kKSteps; k_step++) {
+    // Same real valued formula the oscillator kernels evaluate.
+    const double k = max_k * k_step / kKSteps;
+    for (size_t i = 0; i < kAnalysisSize; i++) {
+      double theta = kTwoPi * i / kAnalysisSize;
+      double phase_m = modulator * theta;
+      spectrum[i] = std::cos(osc.R * k * std::cos(phase_m)) *
+                    std::cos(carrier * theta - osc.S * k * std::sin(phase_m));
+    }
+    FFT(spectrum, false);
+
+    for (int level = 0; level < kNumMipLevels; level++) {
+      const size_t harmonics = kMaxHarmonic >> level;
+      std::fill(mip.begin(), mip.end(), 0.0);
+      mip[0] = spectrum[0];
+      for (size_t h = 1; h <= harmonics; h++) {
+        mip[h] = spectrum[h];
+        mip[kTableSize - h] = spectrum[kAnalysisSize - h];
+      }
+      FFT(mip, true);
+      float *row = &samples_[RowOffset(level, k_step)];
+      for (size_t i = 0; i < kTableSize; i++) {
+        row[i] = static_cast<float>(mip[i].real() / kAnalysisSize);
+      }
+      row[kTableSize] = row[0];
+    }
+  }
+}
+
+int Wavetable::MipLevelFor(float base_freq, float sample_rate) const {
+  const float nyquist = sample_rate / 2;
+  for (int level = 0; level < kNumMipLevels; level++) {
+    if ((kMaxHarmonic >> level) * base_freq < nyquist) return level;
+  }
+  return kNumMipLevels - 1;
+}
@@ -0,0 +1,677 @@
+// Checks every optimized render path against a frozen reference: the ModFM
+// formula evaluated in double precision, sample by sample, with phases
+// accumulated the way Oscillator's default phase mode does. Each path renders
+// the same patch and note scenarios and has to stay within the signal to
+// noise ratio, maximum absolute error and spectral deviation allowed for its
+// quality tier.
+//
+// The reference must not change along with the code under test. If the
+// synthesis itself changes on purpose, change it here in the same commit and
+// say why.
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include <numbers>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "decimator.h"
+#include "envgen.h"
+#include "oscillator.h"
+#include "patch.h"
+#include "player.h"
+#include "wavetable.h"
+
+namespace {
+
+constexpr int kSampleRate = 44100;
+constexpr size_t kFrames = 4096;
+// Rendered in blocks of this size, to cover state carried between calls.
+constexpr size_t kBlockFrames = 256;
+
+struct Scenario {
+  const char *name;
+  GeneratorPatch::Osc osc;
+  float freq;
+};
+
+void PrintTo(const Scenario &scenario, std::ostream *os) {
+  *os << scenario.name;
+}
+
+// Drawbar style integer ratios, detuned ratios, and R and S shapes, from the
+// bottom of the keyboard to the top.
+const Scenario kScenarios[] = {
+    {"sine", {1.0f, 0.5f, 1.0f, 0.0f, 1.0f, 0.0f}, 220.0f},
+    {"bright", {1.0f, 0.5f, 1.0f, 4.0f, 1.0f, 0.0f}, 110.0f},
+    {"detuned", {1.01f, 0.5f, 1.5f, 2.0f, 1.0f, 0.3f}, 261.6f},
+    {"shaped", {2.0f, 0.3f, 0.5f, 3.0f, 0.5f, 1.0f}, 440.0f},
+    {"high", {4.0f, 0.5f, 1.0f, 1.5f, 1.0f, 0.5f}, 880.0f},
+};
+
+// Ramped like a note's attack, so both level arrays vary per frame.
+std::vector<float> Levels(float peak) {
+  std::vector<float> levels(kFrames);
+  for (size_t i = 0; i < kFrames; i++)
+    levels[i] = peak * std::min(1.0f, 0.1f + i / 1024.0f);
+  return levels;
+}
+
+std::vector<double> Reference(const Scenario &s, const std::vector<float> &a,
+                              const std::vector<float> &k) {
+  constexpr double kTwoPi = 2.0 * std::numbers::pi;
+  const double inc_c = static_cast<double>(s.freq) * s.osc.C / kSampleRate;
+  const double inc_m = inc_c * s.osc.M;
+  std::vector<double> out(kFrames);
+  for (size_t i = 0; i < kFrames; i++) {
+    const double phase_c = kTwoPi * std::fmod((i + 1) * inc_c, 1.0);
+    const double phase_m = kTwoPi * std::fmod((i + 1) * inc_m, 1.0);
+    out[i] = a[i] *
+             std::cos(phase_c - s.osc.S * k[i] * std::sin(phase_m)) *
+             std::cos(s.osc.R * k[i] * std::cos(phase_m));
+  }
+  return out;
+}
+
+void FFT(std::vector<std::complex<double>> *data) {
+  auto &x = *data;
+  const size_t n = x.size();
+  for (size_t i = 1, j = 0; i < n; i++) {
+    size_t bit = n >> 1;
+    for (; j & bit; bit >>= 1) j ^= bit;
+    j ^= bit;
+    if (i < j) std::swap(x[i], x[j]);
+  }
+  for (size_t len = 2; len <= n; len <<= 1) {
+    const auto w = std::polar(1.0, -2.0 * std::numbers::pi / len);
+    for (size_t i = 0; i < n; i += len) {
+      std::complex<double> wk = 1.0;
+      for (size_t j = 0; j < len / 2; j++, wk *= w) {
+        auto u = x[i + j];
+        auto v = x[i + j + len / 2] * wk;
+        x[i + j] = u + v;
+        x[i + j + len / 2] = u - v;
+      }
+    }
+  }
+}
+
+// Hann windowed, up to Nyquist.
+std::vector<std::complex<double>> Spectrum(const std::vector<double> &signal) {
+  std::vector<std::complex<double>> x(signal.size());
+  for (size_t i = 0; i < x.size(); i++) {
+    x[i] = signal[i] *
+           (0.5 - 0.5 * std::cos(2.0 * std::numbers::pi * i / x.size()));
+  }
+  FFT(&x);
+  x.resize(x.size() / 2);
+  return x;
+}
+
+struct Error {
+  double snr_db;
+  double max_abs;
+  // Largest difference in any bin of the magnitude spectrum, in dB relative
+  // to the reference's strongest bin.
+  double spectral_db;
+};
+
+// With `band_hz` set, SNR and spectral deviation only count the spectrum
+// below it; the maximum absolute error always covers the whole signal.
+Error Compare(const std::vector<double> &reference,
+              const std::vector<double> &actual, double band_hz = 0.0) {
+  double max_abs = 0.0;
+  for (size_t i = 0; i < reference.size(); i++)
+    max_abs = std::max(max_abs, std::fabs(actual[i] - reference[i]));
+
+  const auto ref_spectrum = Spectrum(reference);
+  const auto spectrum = Spectrum(actual);
+  size_t bins = spectrum.size();
+  if (band_hz > 0.0)
+    bins = std::min<size_t>(bins, band_hz * reference.size() / kSampleRate);
+  double signal = 0.0, noise = 0.0, peak = 0.0, deviation = 0.0;
+  for (size_t i = 0; i < bins; i++) {
+    signal += std::norm(ref_spectrum[i]);
+    noise += std::norm(spectrum[i] - ref_spectrum[i]);
+    peak = std::max(peak, std::abs(ref_spectrum[i]));
+    deviation =
+        std::max(deviation, std::fabs(std::abs(spectrum[i]) -
+                                      std::abs(ref_spectrum[i])));
+  }
+  return {10.0 * std::log10(signal / std::max(noise, 1e-40)), max_abs,
+          20.0 * std::log10(std::max(deviation / peak, 1e-20))};
+}
+
+struct Tier {
+  double min_snr_db;
+  double max_abs;
+  double max_spectral_db;
+};
+
+// Outputs are around unit amplitude, so the bounds in the Oscillator::Quality
+// comments, amplified by the modulation index, set these.
+constexpr Tier kReferenceTier = {110.0, 2e-5, -110.0};
+constexpr Tier kPolynomialTier = {100.0, 5e-5, -100.0};
+constexpr Tier kTableTier = {80.0, 5e-4, -85.0};
+// Float time loses phase precision as the clock runs, the price of
+// PhaseMode::kSampleClock.
+constexpr Tier kSampleClockTier = {75.0, 5e-4, -80.0};
+// Generators get their levels from EnvelopeGenerator::Render(), which
+// rounds differently from the sample by sample reference levels.
+constexpr Tier kGeneratorTier = {95.0, 2e-5, -95.0};
+// Oversampled generators against the same note at 1x: what the decimator's
+// passband ripple and the interpolated levels leave. A frame apart, the
+// SNR would be around 22 dB.
+constexpr Tier kOversampledTier = {70.0, 5e-3, -90.0};
+// Interpolated, band limited tables; see wavetable.h. SNR and spectral
+// deviation are taken over the band a table holds, but the harmonics it leaves
+// out still count towards the maximum absolute error.
+constexpr Tier kWavetableTier = {40.0, 5e-2, -40.0};
+
+void ExpectWithin(const Error &e, const Tier &tier) {
+  testing::Test::RecordProperty("snr_db", std::to_string(e.snr_db));
+  testing::Test::RecordProperty("max_abs_error", std::to_string(e.max_abs));
+  testing::Test::RecordProperty("spectral_deviation_db",
+                                std::to_string(e.spectral_db));
+  EXPECT_GE(e.snr_db, tier.min_snr_db);
+  EXPECT_LE(e.max_abs, tier.max_abs);
+  EXPECT_LE(e.spectral_db, tier.max_spectral_db);
+}
+
+struct OscillatorPath {
+  Oscillator::Quality quality;
+  Oscillator::PhaseMode phase_mode;
+  Oscillator::ISA isa;
+  Tier tier;
+};
+
+std::vector<OscillatorPath> OscillatorPaths() {
+  using Quality = Oscillator::Quality;
+  using PhaseMode = Oscillator::PhaseMode;
+  std::vector<OscillatorPath> paths;
+  for (auto mode : {PhaseMode::kAccumulator, PhaseMode::kPhasor}) {
+    paths.push_back(
+        {Quality::kReference, mode, Oscillator::ISA::kScalar, kReferenceTier});
+    for (int i = 0; i <= static_cast<int>(Oscillator::SupportedISA()); i++) {
+      auto isa = static_cast<Oscillator::ISA>(i);
+      paths.push_back({Quality::kPolynomial, mode, isa, kPolynomialTier});
+    }
+    paths.push_back({Quality::kTable, mode, Oscillator::ISA::kScalar,
+                     kTableTier});
+  }
+  paths.push_back({Quality::kReference, PhaseMode::kSampleClock,
+                   Oscillator::ISA::kScalar, kSampleClockTier});
+  return paths;
+}
+
+std::string PathName(const OscillatorPath &path) {
+  const char *mode = "accumulator";
+  if (path.phase_mode == Oscillator::PhaseMode::kPhasor) mode = "phasor";
+  if (path.phase_mode == Oscillator::PhaseMode::kSampleClock)
+    mode = "sample_clock";
+  std::string name = std::string(Oscillator::QualityName(path.quality)) + "_" +
+                     mode + "_" + Oscillator::ISAName(path.isa);
+  std::replace(name.begin(), name.end(), '-', '_');
+  return name;
+}
+
+void PrintTo(const OscillatorPath &path, std::ostream *os) {
+  *os << PathName(path);
+}
+
+class OscillatorAccuracyTest
+    : public testing::TestWithParam<std::tuple<Scenario, OscillatorPath>> {
+ protected:
+  void TearDown() override {
+    Oscillator::SetActiveISA(Oscillator::SupportedISA());
+  }
+};
+
+TEST_P(OscillatorAccuracyTest, MatchesReference) {
+  const auto &[scenario, path] = GetParam();
+  const auto level_a = Levels(scenario.osc.A);
+  const auto level_k = Levels(scenario.osc.K);
+
+  Oscillator::SetActiveISA(path.isa);
+  Oscillator oscillator;
+  oscillator.SetQuality(path.quality);
+  oscillator.SetPhaseMode(path.phase_mode);
+  std::vector<float> out(kFrames);
+  for (size_t start = 0; start < kFrames; start += kBlockFrames) {
+    oscillator.Perform(kBlockFrames, kSampleRate, out.data() + start,
+                       scenario.freq, scenario.osc, level_a.data() + start,
+                       level_k.data() + start);
+  }
+
+  std::vector<double> actual(kFrames);
+  for (size_t i = 0; i < kFrames; i++) actual[i] = out[i];
+  ExpectWithin(Compare(Reference(scenario, level_a, level_k), actual),
+               path.tier);
+}
+
+INSTANTIATE_TEST_SUITE_P(
+    Paths, OscillatorAccuracyTest,
+    testing::Combine(testing::ValuesIn(kScenarios),
+                     testing::ValuesIn(OscillatorPaths())),
+    [](const auto &info) {
+      return std::string(std::get<0>(info.param).name) + "_" +
+             PathName(std::get<1>(info.param));
+    });
+
+// Handing a note between the table and the formula mid-note picks up where
+// the other left off, in both directions.
+TEST(OscillatorPathTest, TableSwitchKeepsPhase) {
+  const Scenario &scenario = kScenarios[3];
+  const auto wavetable =
+      Wavetable::Get(scenario.osc, scenario.osc.K * Levels(1.0f).back());
+  ASSERT_NE(wavetable, nullptr);
+  const auto level_a = Levels(scenario.osc.A);
+  const auto level_k = Levels(scenario.osc.K);
+
+  Oscillator formula, switching;
+  std::vector<float> expected(kFrames), actual(kFrames);
+  formula.Perform(kFrames, kSampleRate, expected.data(), scenario.freq,
+                  scenario.osc, level_a.data(), level_k.data());
+  for (size_t start = 0; start < kFrames; start += kBlockFrames) {
+    if ((start / kBlockFrames) % 2 == 0) {
+      switching.PerformWavetable(*wavetable, kBlockFrames, kSampleRate,
+                                 actual.data() + start, scenario.freq,
+                                 level_a.data() + start,
+                                 level_k.data() + start);
+    } else {
+      switching.Perform(kBlockFrames, kSampleRate, actual.data() + start,
+                        scenario.freq, scenario.osc, level_a.data() + start,
+                        level_k.data() + start);
+    }
+  }
+  float error = 0.0f;
+  for (size_t i = 0; i < kFrames; i++)
+    error = std::max(error, std::fabs(actual[i] - expected[i]));
+  EXPECT_LT(error, kWavetableTier.max_abs);
+}
+
+// A whole generator, envelopes and all, against the reference fed with
+// levels from EnvelopeGenerator::NextSample(). Below kReference, integer
+// ratio scenarios go through wavetables. kTable runs on the scalar kernel,
+// the only one it applies to.
+class GeneratorAccuracyTest
+    : public testing::TestWithParam<std::tuple<Scenario, Oscillator::Quality>> {
+ protected:
+  void TearDown() override {
+    Oscillator::SetActiveISA(Oscillator::SupportedISA());
+  }
+};
+
+TEST_P(GeneratorAccuracyTest, MatchesReference) {
+  const auto &[scenario, quality] = GetParam();
+  if (quality == Oscillator::Quality::kTable)
+    Oscillator::SetActiveISA(Oscillator::ISA::kScalar);
+  Patch patch;
+  GeneratorPatch *generator_patch = patch.AddGenerator();
+  generator_patch->Update(scenario.osc,
+                          GeneratorPatch::Envelope{0.02f, 1.0f, 0.05f, 0.6f,
+                                                   0.1f},
+                          GeneratorPatch::Envelope{0.03f, 1.0f, 0.04f, 0.8f,
+                                                   0.1f});
+  auto snapshot = patch.snapshot();
+  const auto &gp = snapshot->generators[0];
+
+  EnvelopeGenerator e_a(kSampleRate), e_k(kSampleRate);
+  const auto a_program = EnvelopeProgram::FromEnvelope(gp.a_env);
+  const auto k_program = EnvelopeProgram::FromEnvelope(gp.k_env);
+  e_a.NoteOn(a_program);
+  e_k.NoteOn(k_program);
+  std::vector<float> level_a(kFrames), level_k(kFrames);
+  for (size_t i = 0; i < kFrames; i++) {
+    level_a[i] = scenario.osc.A * e_a.NextSample(a_program);
+    level_k[i] = scenario.osc.K * e_k.NextSample(k_program);
+  }
+
+  Generator generator(kSampleRate);
+  generator.SetQuality(quality);
+  generator.NoteOn(gp, 0, 127, 60);
+  ControllerValues controllers{};
+  // Output lags by the latency oversampled generators have.
+  const size_t latency = generator.latency();
+  std::vector<float> out(kFrames + latency + kBlockFrames);
+  for (size_t start = 0; start < kFrames + latency; start += kBlockFrames) {
+    generator.Perform(gp, out.data() + start, scenario.freq, controllers,
+                      kBlockFrames);
+  }
+
+  std::vector<double> actual(kFrames);
+  for (size_t i = 0; i < kFrames; i++) actual[i] = out[latency + i];
+  const auto reference = Reference(scenario, level_a, level_k);
+  if (quality == Oscillator::Quality::kReference || !gp.wavetable) {
+    ExpectWithin(Compare(reference, actual),
+                 quality == Oscillator::Quality::kTable ? kTableTier
+                                                        : kGeneratorTier);
+    return;
+  }
+  // Tables only hold the harmonics below Nyquist for the lowest note of
+  // their mip level, so they are judged on that band.
+  const auto &table = *gp.wavetable;
+  const int mip_level = table.MipLevelFor(scenario.freq, kSampleRate);
+  ExpectWithin(
+      Compare(reference, actual,
+              (Wavetable::kMaxHarmonic >> mip_level) * scenario.freq + 1.0f),
+      kWavetableTier);
+}
+
+INSTANTIATE_TEST_SUITE_P(
+    Qualities, GeneratorAccuracyTest,
+    testing::Combine(testing::ValuesIn(kScenarios),
+                     testing::Values(Oscillator::Quality::kReference,
+                                     Oscillator::Quality::kPolynomial,
+                                     Oscillator::Quality::kTable)),
+    [](const auto &info) {
+      return std::string(std::get<0>(info.param).name) + "_" +
+             Oscillator::QualityName(std::get<1>(info.param));
+    });
+
+// A note whose whole spectrum is above Nyquist isn't rendered but keeps
+// playing, so it sounds again once a patch edit brings it back down, and
+// still finishes its release.
+TEST(GeneratorRangeTest, UltrasonicNoteSkipsUntilLowered) {
+  Patch patch;
+  GeneratorPatch *generator_patch = patch.AddGenerator();
+  const GeneratorPatch::Envelope env{0.01f, 1.0f, 0.05f, 0.6f, 0.1f};
+  auto with_carrier = [&](float c) {
+    const GeneratorPatch::Osc osc{c, 0.5f, 1.0f, 0.0f, 1.0f, 0.0f};
+    generator_patch->Update(osc, env, env);
+    return PatchSnapshot::Generator(patch.snapshot()->generators[0]);
+  };
+  const auto high = with_carrier(200.0f);
+  const auto low = with_carrier(1.0f);
+
+  Generator generator(kSampleRate);
+  generator.NoteOn(high, 0, 127, 69);
+  generator.UpdateRange(high, 440.0f);
+  EXPECT_TRUE(generator.ultrasonic());
+  EXPECT_FALSE(generator.Cull(high, 1e-4f));
+  generator.Skip(high, kFrames);
+  EXPECT_TRUE(generator.Playing());
+
+  generator.UpdateRange(low, 440.0f);
+  EXPECT_FALSE(generator.ultrasonic());
+  ControllerValues controllers{};
+  std::vector<float> out(kBlockFrames);
+  generator.Perform(low, out.data(), 440.0f, controllers, kBlockFrames);
+  float peak = 0.0f;
+  for (float x : out) peak = std::max(peak, std::fabs(x));
+  // Past the attack, at the sustain level.
+  EXPECT_NEAR(peak, 0.5f * 0.6f, 0.01f);
+
+  generator.NoteOff(high, 69);
+  generator.UpdateRange(high, 440.0f);
+  EXPECT_TRUE(generator.ultrasonic());
+  generator.Skip(high, kSampleRate * env.R_R + 1);
+  EXPECT_FALSE(generator.Playing());
+}
+
+// An envelope routed onto A can take it past its depth when the envelope
+// peaks above 1, so a note that gets that loud mustn't be culled as quiet.
+TEST(GeneratorRangeTest, AboveUnityEnvelopeRouteNotCulled) {
+  using Modulation = GeneratorPatch::Modulation;
+  Patch patch;
+  GeneratorPatch *generator_patch = patch.AddGenerator();
+  const GeneratorPatch::Osc osc{1.5f, 0.001f, 1.0f, 0.0f, 1.0f, 0.0f};
+  const GeneratorPatch::Envelope env{0.01f, 4.0f, 0.05f, 4.0f, 0.1f};
+  generator_patch->Update(osc, env, env);
+  Modulation modulation;
+  modulation.routes[0] = {Modulation::Source::kAmpEnvelope,
+                          Modulation::Target::kA, 0, 0.01f};
+  modulation.num_routes = 1;
+  generator_patch->SetModulation(modulation);
+  const auto gp = PatchSnapshot::Generator(patch.snapshot()->generators[0]);
+
+  Generator generator(kSampleRate);
+  generator.NoteOn(gp, 0, 127, 69);
+  constexpr float kThreshold = 0.05f;
+  EXPECT_FALSE(generator.Cull(gp, kThreshold));
+
+  ControllerValues controllers{};
+  std::vector<float> out(kSampleRate / 10);
+  generator.Perform(gp, out.data(), 440.0f, controllers, out.size());
+  float peak = 0.0f;
+  for (float x : out) peak = std::max(peak, std::fabs(x));
+  EXPECT_GT(peak, kThreshold);
+  EXPECT_FALSE(generator.Cull(gp, kThreshold));
+}
+
+// With index clamping, K is held where the highest sideband stays below
+// Nyquist, which is the reference at the clamped index.
+TEST(GeneratorRangeTest, ClampedIndexMatchesReference) {
+  const Scenario scenario = {
+      "clamped", {1.0f, 0.5f, 1.5f, 20.0f, 1.0f, 0.0f}, 3000.0f};
+  const float nyquist = 0.5f * kSampleRate;
+  const float spacing = scenario.freq * scenario.osc.M;
+  const float k_limit =
+      ((nyquist - scenario.freq) / spacing - 1.0f) / scenario.osc.R;
+  ASSERT_LT(k_limit, scenario.osc.K);
+
+  Patch patch;
+  GeneratorPatch *generator_patch = patch.AddGenerator();
+  const GeneratorPatch::Envelope env{0.01f, 1.0f, 0.05f, 0.6f, 0.1f};
+  generator_patch->Update(scenario.osc, env, env);
+  auto snapshot = patch.snapshot();
+  const auto &gp = snapshot->generators[0];
+
+  EnvelopeGenerator e_a(kSampleRate), e_k(kSampleRate);
+  const auto program = EnvelopeProgram::FromEnvelope(env);
+  e_a.NoteOn(program);
+  e_k.NoteOn(program);
+  std::vector<float> level_a(kFrames), level_k(kFrames);
+  for (size_t i = 0; i < kFrames; i++) {
+    level_a[i] = scenario.osc.A * e_a.NextSample(program);
+    level_k[i] = std::min(scenario.osc.K * e_k.NextSample(program), k_limit);
+  }
+
+  Generator generator(kSampleRate);
+  generator.SetMaxOversampling(1);
+  generator.SetIndexClamping(true);
+  generator.NoteOn(gp, 0, 127, 60);
+  generator.UpdateRange(gp, scenario.freq);
+  EXPECT_FALSE(generator.ultrasonic());
+  ControllerValues controllers{};
+  std::vector<float> out(kFrames);
+  for (size_t start = 0; start < kFrames; start += kBlockFrames) {
+    generator.Perform(gp, out.data() + start, scenario.freq, controllers,
+                      kBlockFrames);
+  }
+  std::vector<double> actual(out.begin(), out.end());
+  ExpectWithin(Compare(Reference(scenario, level_a, level_k), actual),
+               kGeneratorTier);
+}
+
+// Least squares amplitude of a tone at `freq` cycles per frame in `signal`.
+double ToneAmplitude(const std::vector<float> &signal, double freq) {
+  double ss = 0.0, cc = 0.0, sc = 0.0, ys = 0.0, yc = 0.0;
+  for (size_t i = 0; i < signal.size(); i++) {
+    const double s = std::sin(2.0 * std::numbers::pi * freq * i);
+    const double c = std::cos(2.0 * std::numbers::pi * freq * i);
+    ss += s * s;
+    cc += c * c;
+    sc += s * c;
+    ys += signal[i] * s;
+    yc += signal[i] * c;
+  }
+  const double det = ss * cc - sc * sc;
+  return std::hypot((ys * cc - yc * sc) / det, (yc * ss - ys * sc) / det);
+}
+
+// A unit tone at `freq` cycles per output frame through the decimator, once
+// the filters have settled.
+std::vector<float> Decimate(int factor, double freq) {
+  constexpr size_t kSettle = 64;
+  Decimator decimator;
+  std::vector<float> in(factor * kFrames), out(kFrames);
+  for (size_t i = 0; i < in.size(); i++)
+    in[i] = std::sin(2.0 * std::numbers::pi * freq * i / factor);
+  decimator.Process(factor, in.data(), out.data(), kFrames);
+  out.erase(out.begin(), out.begin() + kSettle);
+  return out;
+}
+
+class DecimatorTest : public testing::TestWithParam<int> {};
+
+// The response decimator.h promises: flat to 0.4 of the output rate and down
+// 70 dB from 0.6 all the way up to the input's Nyquist.
+TEST_P(DecimatorTest, Response) {
+  const int factor = GetParam();
+  double passband = 0.0, stopband = -200.0;
+  for (double freq = 0.005; freq <= 0.4; freq += 0.005) {
+    const double gain = ToneAmplitude(Decimate(factor, freq), freq);
+    passband = std::max(passband, std::fabs(20.0 * std::log10(gain)));
+  }
+  // What gets through comes out folded to anywhere, DC included, so this
+  // goes by the RMS.
+  for (double freq = 0.6; freq < 0.5 * factor; freq += 0.005) {
+    const auto out = Decimate(factor, freq);
+    double power = 0.0;
+    for (float x : out) power += x * x;
+    const double gain = std::sqrt(2.0 * power / out.size());
+    stopband = std::max(stopband, 20.0 * std::log10(gain));
+  }
+  testing::Test::RecordProperty("passband_db", std::to_string(passband));
+  testing::Test::RecordProperty("stopband_db", std::to_string(stopband));
+  EXPECT_LE(passband, 0.01);
+  EXPECT_LE(stopband, -70.0);
+}
+
+INSTANTIATE_TEST_SUITE_P(Factors, DecimatorTest, testing::Values(2, 4));
+
+class OversamplingTest : public testing::TestWithParam<int> {};
+
+// A band limited note rendered at 1x and forced through the decimator at a
+// higher factor comes out the same, onset included: the decimator's delay is
+// made up on the 1x path.
+TEST_P(OversamplingTest, FactorsLineUp) {
+  const int factor = GetParam();
+  const Scenario &scenario = kScenarios[2];
+  Patch patch;
+  GeneratorPatch *generator_patch = patch.AddGenerator();
+  const GeneratorPatch::Envelope env{0.02f, 1.0f, 0.05f, 0.6f, 0.1f};
+  generator_patch->Update(scenario.osc, env, env);
+  auto snapshot = patch.snapshot();
+  const auto &gp = snapshot->generators[0];
+
+  Generator direct(kSampleRate), oversampled(kSampleRate);
+  direct.SetMaxOversampling(factor);
+  oversampled.SetMaxOversampling(factor);
+  oversampled.SetMinOversampling(factor);
+  ASSERT_EQ(direct.latency(), oversampled.latency());
+  ControllerValues controllers{};
+  std::vector<float> direct_out(kFrames), oversampled_out(kFrames);
+  for (auto *g : {&direct, &oversampled}) {
+    g->SetQuality(Oscillator::Quality::kReference);
+    g->NoteOn(gp, 0, 127, 60);
+    g->UpdateRange(gp, scenario.freq);
+    auto &out = g == &direct ? direct_out : oversampled_out;
+    for (size_t start = 0; start < kFrames; start += kBlockFrames) {
+      g->Perform(gp, out.data() + start, scenario.freq, controllers,
+                 kBlockFrames);
+    }
+  }
+  EXPECT_EQ(direct.oversampling(), 1);
+  EXPECT_EQ(oversampled.oversampling(), factor);
+  ExpectWithin(Compare(std::vector<double>(direct_out.begin(),
+                                           direct_out.end()),
+                       std::vector<double>(oversampled_out.begin(),
+                                           oversampled_out.end())),
+               kOversampledTier);
+}
+
+INSTANTIATE_TEST_SUITE_P(Factors, OversamplingTest, testing::Values(2, 4));
+
+// Render() evaluates segments in closed form eight frames at a time; it has
+// to track the sample by sample recurrence of NextSample() through every
+// stage, including a note off mid segment.
+TEST(EnvelopeAccuracyTest, RenderMatchesNextSample) {
+  const auto program =
+      EnvelopeProgram::FromEnvelope({0.01f, 1.0f, 0.05f, 0.5f, 0.03f});
+  EnvelopeGenerator reference(kSampleRate), rendered(kSampleRate);
+  reference.NoteOn(program);
+  rendered.NoteOn(program);
+  // Odd block sizes, so segment boundaries fall mid block.
+  constexpr size_t kBlock = 37;
+  constexpr size_t kNoteOff = 3700;
+  double max_error = 0.0;
+  std::vector<float> out(kBlock);
+  for (size_t start = 0; start < 2 * kNoteOff; start += kBlock) {
+    if (start >= kNoteOff && start < kNoteOff + kBlock) {
+      reference.NoteOff(program);
+      rendered.NoteOff(program);
+    }
+    rendered.Render(program, 1.0f, out.data(), kBlock);
+    for (size_t i = 0; i < kBlock; i++) {
+      max_error = std::max<double>(
+          max_error, std::fabs(out[i] - reference.NextSample(program)));
+    }
+  }
+  testing::Test::RecordProperty("max_abs_error", std::to_string(max_error));
+  EXPECT_LE(max_error, 1e-5);
+  EXPECT_EQ(rendered.Stage(), reference.Stage());
+}
+
+// A multi-stage envelope whose middle segments loop while the note is held,
+// taking Render() through segment boundaries and loop jumps mid block.
+TEST(EnvelopeAccuracyTest, LoopingRenderMatchesNextSample) {
+  GeneratorPatch::Envelope env{0.01f, 1.0f, 0.02f, 0.5f, 0.03f};
+  env.segments[0] = {0.9f, 0.013f};
+  env.segments[1] = {0.2f, 0.007f};
+  env.segments[2] = {0.4f, 0.05f};
+  env.num_segments = 3;
+  env.loop_start = 2;
+  env.loop_end = 3;
+  const auto program = EnvelopeProgram::FromEnvelope(env);
+  EnvelopeGenerator reference(kSampleRate), rendered(kSampleRate);
+  reference.NoteOn(program);
+  rendered.NoteOn(program);
+  constexpr size_t kBlock = 37;
+  constexpr size_t kNoteOff = 8000;
+  double max_error = 0.0;
+  std::vector<float> out(kBlock);
+  for (size_t start = 0; start < 2 * kNoteOff; start += kBlock) {
+    if (start >= kNoteOff && start < kNoteOff + kBlock) {
+      EXPECT_EQ(rendered.Stage(), EnvelopeGenerator::ENVELOPE_STAGE_DECAY);
+      reference.NoteOff(program);
+      rendered.NoteOff(program);
+    }
+    rendered.Render(program, 1.0f, out.data(), kBlock);
+    for (size_t i = 0; i < kBlock; i++) {
+      max_error = std::max<double>(
+          max_error, std::fabs(out[i] - reference.NextSample(program)));
+    }
+  }
+  testing::Test::RecordProperty("max_abs_error", std::to_string(max_error));
+  EXPECT_LE(max_error, 1e-5);
+  EXPECT_EQ(rendered.Stage(), reference.Stage());
+  EXPECT_FALSE(rendered.Playing());
+}
+
+// A loop over segments that take no time holds at its end rather than
+// spinning forever.
+TEST(EnvelopeAccuracyTest, ZeroLengthLoopHolds) {
+  GeneratorPatch::Envelope env{0.0f, 1.0f, 0.0f, 0.5f, 0.03f};
+  env.segments[0] = {0.8f, 0.0f};
+  env.num_segments = 1;
+  env.loop_start = 1;
+  env.loop_end = 2;
+  const auto program = EnvelopeProgram::FromEnvelope(env);
+  EnvelopeGenerator reference(kSampleRate), rendered(kSampleRate);
+  reference.NoteOn(program);
+  rendered.NoteOn(program);
+  std::vector<float> out(kBlockFrames);
+  rendered.Render(program, 1.0f, out.data(), kBlockFrames);
+  EXPECT_EQ(rendered.Stage(), EnvelopeGenerator::ENVELOPE_STAGE_SUSTAIN);
+  EXPECT_FLOAT_EQ(out.back(), 0.8f);
+  EXPECT_FLOAT_EQ(reference.NextSample(program), 0.8f);
+  EXPECT_EQ(reference.Stage(), EnvelopeGenerator::ENVELOPE_STAGE_SUSTAIN);
+}
+
+}  // namespace